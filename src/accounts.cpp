@@ -29,6 +29,7 @@
   
 #include "accounts.h"
 #include "utility.h"
+#include <ctype.h>
 
 Accounts::DomainList::DomainList(Accounts::DomainList *newNext, const char* newDomain, const char* newDirectory)
 : next(newNext)
@@ -58,6 +59,215 @@ Accounts::LockTree::~LockTree()
 	delete right;
 }
 
+Accounts::MailboxCache::Entry::Entry(const char* newKey, MAILBOX_STATUS newStatus,
+									 const char* dir, time_t newExpires)
+: next(NULL),
+mailbox_dir(NULL),
+status(newStatus),
+expires(newExpires)
+{
+	key = strdupnew(newKey);
+	if(dir)
+		mailbox_dir = strdupnew(dir);
+}
+
+Accounts::MailboxCache::Entry::~Entry()
+{
+	delete[] key;
+	delete[] mailbox_dir;
+}
+
+Accounts::MailboxCache::MailboxCache()
+: locksCreated(true),
+ttl(0)
+{
+	for(unsigned int i = 0; i < MAILBOX_CACHE_BUCKETS; ++i)
+		buckets[i] = NULL;
+
+	for(unsigned int i = 0; i < MAILBOX_CACHE_LOCKS; ++i)
+	{
+		if(!create_mutex(locks[i]))
+		{
+			// Leave the cache off.
+			while(i > 0)
+				delete_mutex(locks[--i]);
+			locksCreated = false;
+			break;
+		}
+	}
+}
+
+Accounts::MailboxCache::~MailboxCache()
+{
+	for(unsigned int i = 0; i < MAILBOX_CACHE_BUCKETS; ++i)
+	{
+		while(buckets[i])
+		{
+			Entry *next = buckets[i]->next;
+			delete buckets[i];
+			buckets[i] = next;
+		}
+	}
+
+	if(locksCreated)
+	{
+		for(unsigned int i = 0; i < MAILBOX_CACHE_LOCKS; ++i)
+			delete_mutex(locks[i]);
+	}
+}
+
+bool Accounts::MailboxCache::find(const char* key, unsigned int hash,
+								  MAILBOX_STATUS* pstatus, char** pmailbox_dir)
+{
+	unsigned int bucket = hash % MAILBOX_CACHE_BUCKETS;
+	MUTEX & lock = locks[bucket % MAILBOX_CACHE_LOCKS];
+
+	if(!wait_mutex(lock))
+		return false;
+
+	time_t now = time(NULL);
+	bool found = false;
+	Entry **pp = &buckets[bucket];
+
+	while(*pp)
+	{
+		Entry *e = *pp;
+
+		if(e->expires <= now)
+		{
+			*pp = e->next;
+			delete e;
+			continue;
+		}
+
+		if(strcmp(e->key, key) == 0)
+		{
+			*pstatus = e->status;
+			if(pmailbox_dir && e->mailbox_dir)
+				*pmailbox_dir = strdupnew(e->mailbox_dir);
+			found = true;
+			break;
+		}
+
+		pp = &e->next;
+	}
+
+	release_mutex(lock);
+	return found;
+}
+
+void Accounts::MailboxCache::add(const char* key, unsigned int hash,
+								 MAILBOX_STATUS status, const char* mailbox_dir)
+{
+	unsigned int bucket = hash % MAILBOX_CACHE_BUCKETS;
+	MUTEX & lock = locks[bucket % MAILBOX_CACHE_LOCKS];
+
+	// Make the copies before taking the lock.
+	Entry *n = new Entry(key, status, mailbox_dir, time(NULL) + ttl);
+
+	if(!wait_mutex(lock))
+	{
+		delete n;
+		return;
+	}
+
+	// The new entry goes at the front. Drop any old one for the same
+	// mailbox, and the oldest entries if the chain is too long.
+	n->next = buckets[bucket];
+	buckets[bucket] = n;
+
+	unsigned int count = 1;
+	Entry **pp = &n->next;
+
+	while(*pp)
+	{
+		Entry *e = *pp;
+
+		if(count >= MAILBOX_CACHE_CHAIN || strcmp(e->key, key) == 0)
+		{
+			*pp = e->next;
+			delete e;
+		}
+		else
+		{
+			++count;
+			pp = &e->next;
+		}
+	}
+
+	release_mutex(lock);
+}
+
+void Accounts::MailboxCache::remove(const char* key, unsigned int hash)
+{
+	unsigned int bucket = hash % MAILBOX_CACHE_BUCKETS;
+	MUTEX & lock = locks[bucket % MAILBOX_CACHE_LOCKS];
+
+	if(!wait_mutex(lock))
+		return;
+
+	for(Entry **pp = &buckets[bucket]; *pp; pp = &(*pp)->next)
+	{
+		if(strcmp((*pp)->key, key) == 0)
+		{
+			Entry *e = *pp;
+			*pp = e->next;
+			delete e;
+			break;
+		}
+	}
+
+	release_mutex(lock);
+}
+
+void Accounts::MailboxCache::clear()
+{
+	for(unsigned int l = 0; l < MAILBOX_CACHE_LOCKS; ++l)
+	{
+		if(!wait_mutex(locks[l]))
+			continue;
+
+		for(unsigned int i = l; i < MAILBOX_CACHE_BUCKETS; i += MAILBOX_CACHE_LOCKS)
+		{
+			while(buckets[i])
+			{
+				Entry *next = buckets[i]->next;
+				delete buckets[i];
+				buckets[i] = next;
+			}
+		}
+
+		release_mutex(locks[l]);
+	}
+}
+
+bool Accounts::mailboxCacheKey(const char* domain, const char* mailbox,
+							   char* buf, size_t bufsize, unsigned int* phash)
+{
+	// Mailbox names are case sensitive, but domain names aren't.
+	size_t mailbox_len = strlen(mailbox);
+	size_t domain_len = strlen(domain);
+
+	if(mailbox_len + domain_len + 2 > bufsize)
+		return false;
+
+	memcpy(buf, mailbox, mailbox_len);
+	buf[mailbox_len] = '@';
+
+	char *d = buf + mailbox_len + 1;
+	for(size_t i = 0; i < domain_len; ++i)
+		d[i] = tolower((unsigned char)domain[i]);
+	d[domain_len] = 0;
+
+	// FNV-1a.
+	unsigned int hash = 2166136261u;
+	for(const char *p = buf; *p; ++p)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+	*phash = hash;
+	return true;
+}
+
 Accounts::Accounts()
 : m_domain_list(0),
 m_lock_tree(0)
@@ -78,6 +288,15 @@ MAILBOX_STATUS Accounts::isMailboxOk(const char* domain,
 									 const char* mailbox,
 									 char** pmailbox_dir) const
 {
+	char key[MAX_PATH + 1];
+	unsigned int hash;
+	bool cache = m_mailbox_cache.ttl > 0 && m_mailbox_cache.locksCreated &&
+		mailboxCacheKey(domain, mailbox, key, sizeof key, &hash);
+
+	MAILBOX_STATUS status;
+	if(cache && m_mailbox_cache.find(key, hash, &status, pmailbox_dir))
+		return status;
+
 	const char* mailbox_dir = 0;
 
 	for(DomainList* p = m_domain_list; p && !mailbox_dir; p = p->next)
@@ -86,6 +305,8 @@ MAILBOX_STATUS Accounts::isMailboxOk(const char* domain,
 			mailbox_dir = p->mailbox_directory;
 	}
 
+	// Other domains aren't cached. There are too many of them and finding
+	// out costs nothing.
 	if(!mailbox_dir)
 		return MS_DOMAIN_NOT_LOCAL;
 
@@ -93,7 +314,14 @@ MAILBOX_STATUS Accounts::isMailboxOk(const char* domain,
 	safe_snprintf(buf, sizeof buf, "%s/%s", mailbox_dir, mailbox);
 
 	if(!isdir(buf))
+	{
+		if(cache)
+			m_mailbox_cache.add(key, hash, MS_MAILBOX_NOT_FOUND, NULL);
 		return MS_MAILBOX_NOT_FOUND;
+	}
+
+	if(cache)
+		m_mailbox_cache.add(key, hash, MS_OK, buf);
 
 	if(pmailbox_dir)
 		*pmailbox_dir = strdupnew(buf);
@@ -101,6 +329,27 @@ MAILBOX_STATUS Accounts::isMailboxOk(const char* domain,
 	return MS_OK;
 }
 
+void Accounts::setMailboxCacheTtl(unsigned int seconds)
+{
+	m_mailbox_cache.ttl = seconds;
+	invalidateMailboxes();
+}
+
+void Accounts::invalidateMailbox(const char* domain, const char* mailbox) const
+{
+	char key[MAX_PATH + 1];
+	unsigned int hash;
+
+	if(m_mailbox_cache.locksCreated && mailboxCacheKey(domain, mailbox, key, sizeof key, &hash))
+		m_mailbox_cache.remove(key, hash);
+}
+
+void Accounts::invalidateMailboxes() const
+{
+	if(m_mailbox_cache.locksCreated)
+		m_mailbox_cache.clear();
+}
+
 void Accounts::addDomain(const char* domain, const char* mailbox_directory)
 {
 	m_domain_list = new DomainList(m_domain_list, domain, mailbox_directory);
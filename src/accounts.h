@@ -31,9 +31,16 @@
 #define MAILSERV_ACCOUNTS_H
 
 #include <stdio.h>
+#include <time.h>
 #include "log.h"
 #include "thread.h"
 
+// The mailbox cache has this many hash chains, guarded by MAILBOX_CACHE_LOCKS
+// mutexes, and keeps at most MAILBOX_CACHE_CHAIN entries in each chain.
+#define MAILBOX_CACHE_BUCKETS 1024
+#define MAILBOX_CACHE_LOCKS 16
+#define MAILBOX_CACHE_CHAIN 8
+
 enum MAILBOX_STATUS
 {
 	MS_OK,
@@ -71,6 +78,52 @@ class Accounts
 
 	MUTEX m_LockTreeMutex;
 
+	// MailboxCache remembers what isMailboxOk found out about mailboxes in
+	// local domains for a while, both those that exist and those that don't,
+	// so looking up the same recipients again doesn't have to stat their
+	// directories. It is used from all the session and sender threads.
+	struct MailboxCache
+	{
+		struct Entry
+		{
+			Entry *next;
+			char* key; // mailbox@domain, with the domain in lower case.
+			char* mailbox_dir; // The mailbox directory if status is MS_OK.
+			MAILBOX_STATUS status;
+			time_t expires;
+
+			Entry(const char* newKey, MAILBOX_STATUS newStatus, const char* dir, time_t newExpires);
+			~Entry();
+		};
+
+		Entry *buckets[MAILBOX_CACHE_BUCKETS]; // A bucket is guarded by locks[bucket % MAILBOX_CACHE_LOCKS].
+		MUTEX locks[MAILBOX_CACHE_LOCKS];
+		bool locksCreated;
+		unsigned int ttl; // In seconds. 0 turns the cache off.
+
+		MailboxCache();
+		~MailboxCache();
+
+		// Find the entry for key and set *pstatus to it, and *pmailbox_dir
+		// to a copy made with strdupnew if the mailbox exists and
+		// pmailbox_dir isn't NULL. Returns false if there isn't one.
+		bool find(const char* key, unsigned int hash, MAILBOX_STATUS* pstatus, char** pmailbox_dir);
+
+		// Add or replace the entry for key.
+		void add(const char* key, unsigned int hash, MAILBOX_STATUS status, const char* mailbox_dir);
+
+		// Drop the entry for key, if there is one.
+		void remove(const char* key, unsigned int hash);
+
+		// Drop every entry.
+		void clear();
+	} mutable m_mailbox_cache;
+
+	// Builds the mailbox cache key for (domain, mailbox) in buf and gets its
+	// hash. Returns false if it doesn't fit.
+	static bool mailboxCacheKey(const char* domain, const char* mailbox,
+		char* buf, size_t bufsize, unsigned int* phash);
+
 public:
 	Accounts();
 	~Accounts();
@@ -82,6 +135,17 @@ public:
 		const char* mailbox,
 		char** pmailbox_dir = NULL) const;
 
+	// How many seconds isMailboxOk may remember its answer for a mailbox.
+	// 0, the default, makes it look every time.
+	void setMailboxCacheTtl(unsigned int seconds);
+
+	// Make isMailboxOk look at the mailbox again next time, because it
+	// has been created or removed.
+	void invalidateMailbox(const char* domain, const char* mailbox) const;
+
+	// Forget everything isMailboxOk remembers.
+	void invalidateMailboxes() const;
+
 	// Add a domain for the server to be responsible for. The mailbox directory
 	// contains all of the user mailboxes.
 	void addDomain(const char* domain, const char* mailbox_directory);
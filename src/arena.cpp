@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "arena.h"
+#include <string.h>
+
+// Allocations are rounded up to this, which suits any built-in type.
+#define ARENA_ALIGN 8
+
+// The block header is padded so the memory after it is aligned too.
+#define ARENA_HEADER_SIZE ((sizeof(Block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+Arena::Arena(size_t block_size)
+: m_blocks(0),
+m_block_size(block_size)
+{
+}
+
+Arena::~Arena()
+{
+	while(m_blocks)
+	{
+		Block *next = m_blocks->next;
+		delete[] (char*)m_blocks;
+		m_blocks = next;
+	}
+}
+
+void* Arena::alloc(size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if(!m_blocks || m_blocks->size - m_blocks->used < size)
+	{
+		// Anything too big for a block gets one to itself.
+		size_t block_size = size > m_block_size ? size : m_block_size;
+		Block *b = (Block*)new char[ARENA_HEADER_SIZE + block_size];
+		b->next = m_blocks;
+		b->size = block_size;
+		b->used = 0;
+		m_blocks = b;
+	}
+
+	void *p = (char*)m_blocks + ARENA_HEADER_SIZE + m_blocks->used;
+	m_blocks->used += size;
+	return p;
+}
+
+char* Arena::copy(const char* src)
+{
+	size_t len = strlen(src) + 1;
+	char *dest = (char*)alloc(len);
+	memcpy(dest, src, len);
+	return dest;
+}
+
+void Arena::reset()
+{
+	if(!m_blocks)
+		return;
+
+	// The first block is at the end of the list.
+	while(m_blocks->next)
+	{
+		Block *next = m_blocks->next;
+		delete[] (char*)m_blocks;
+		m_blocks = next;
+	}
+
+	m_blocks->used = 0;
+}
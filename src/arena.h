@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// arena.h - a bump allocator for data that is all thrown away at once.
+
+#ifndef MAILSERV_ARENA_H
+#define MAILSERV_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 4096
+
+// Arena hands out memory from big blocks by moving a pointer along, and frees
+// all of it at once with reset. Nothing allocated from it is freed or has its
+// destructor run on its own. Not thread safe.
+class Arena
+{
+	struct Block
+	{
+		Block *next; // The block filled before this one.
+		size_t size; // The number of bytes after the header.
+		size_t used;
+	};
+
+	Block *m_blocks; // The block being filled, or NULL before the first allocation.
+	size_t m_block_size;
+
+	// Not copyable. These have no definition.
+	Arena(const Arena &);
+	const Arena & operator=(const Arena &);
+
+public:
+	Arena(size_t block_size = ARENA_BLOCK_SIZE);
+	~Arena();
+
+	// Get size bytes, aligned for any built-in type.
+	void* alloc(size_t size);
+
+	// Copy a NULL terminated string into the arena.
+	char* copy(const char* src);
+
+	// Free everything allocated. The first block is kept for reuse.
+	void reset();
+};
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "data_scanner.h"
+#include "utility.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DATA_SCANNER_X86
+#include <immintrin.h>
+#endif
+
+// Starting at offset i, skip the 32 byte blocks of buf that have no LF in them.
+// Returns the offset of the first block that has one and sets the bits of *plf
+// and *plfdot as described for DataScanner::block. Only blocks that can be
+// read along with the byte after them are searched. If none of them has an LF
+// the offset of the first block left over is returned and *plf is 0.
+typedef unsigned int (*NextBlockFunc)(const char* buf, unsigned int i, unsigned int len,
+									  unsigned int* plf, unsigned int* plfdot);
+
+static unsigned int next_block_scalar(const char* buf, unsigned int i, unsigned int len,
+									  unsigned int* plf, unsigned int* plfdot)
+{
+	for(; i + 33 <= len; i += 32)
+	{
+		const char *p = (const char*)memchr(buf + i, LF, 32);
+		if(!p)
+			continue;
+
+		unsigned int lf = 0, lfdot = 0;
+		for(unsigned int j = (unsigned int)(p - (buf + i)); j < 32; ++j)
+		{
+			if(buf[i + j] == LF)
+			{
+				lf |= 1u << j;
+				if(buf[i + j + 1] == '.')
+					lfdot |= 1u << j;
+			}
+		}
+
+		*plf = lf;
+		*plfdot = lfdot;
+		return i;
+	}
+
+	*plf = *plfdot = 0;
+	return i;
+}
+
+#ifdef DATA_SCANNER_X86
+static unsigned int next_block_sse2(const char* buf, unsigned int i, unsigned int len,
+									unsigned int* plf, unsigned int* plfdot)
+{
+	const __m128i lf = _mm_set1_epi8(LF);
+	const __m128i dot = _mm_set1_epi8('.');
+
+	for(; i + 33 <= len; i += 32)
+	{
+		const char *p = buf + i;
+		__m128i lo = _mm_loadu_si128((const __m128i*)p);
+		__m128i hi = _mm_loadu_si128((const __m128i*)(p + 16));
+		unsigned int lfmask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, lf)) |
+			((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, lf)) << 16);
+
+		if(lfmask == 0)
+			continue;
+
+		// The same block one byte further on lines each byte up with the one after it.
+		lo = _mm_loadu_si128((const __m128i*)(p + 1));
+		hi = _mm_loadu_si128((const __m128i*)(p + 17));
+		unsigned int dotmask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, dot)) |
+			((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, dot)) << 16);
+
+		*plf = lfmask;
+		*plfdot = lfmask & dotmask;
+		return i;
+	}
+
+	*plf = *plfdot = 0;
+	return i;
+}
+
+__attribute__((target("avx2")))
+static unsigned int next_block_avx2(const char* buf, unsigned int i, unsigned int len,
+									unsigned int* plf, unsigned int* plfdot)
+{
+	const __m256i lf = _mm256_set1_epi8(LF);
+	const __m256i dot = _mm256_set1_epi8('.');
+
+	for(; i + 33 <= len; i += 32)
+	{
+		const char *p = buf + i;
+		unsigned int lfmask = (unsigned int)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), lf));
+
+		if(lfmask == 0)
+			continue;
+
+		unsigned int dotmask = (unsigned int)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 1)), dot));
+
+		*plf = lfmask;
+		*plfdot = lfmask & dotmask;
+		return i;
+	}
+
+	*plf = *plfdot = 0;
+	return i;
+}
+#endif
+
+// Pick the fastest search the processor supports.
+static NextBlockFunc choose_next_block()
+{
+#ifdef DATA_SCANNER_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return next_block_avx2;
+	if(__builtin_cpu_supports("sse2"))
+		return next_block_sse2;
+#endif
+	return next_block_scalar;
+}
+
+static const NextBlockFunc next_block = choose_next_block();
+
+// The positions of the lowest and highest set bits of x, which must not be 0.
+static inline int lowest_bit(unsigned int x)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(x);
+#else
+	int n = 0;
+	while(!(x & 1))
+	{
+		x >>= 1;
+		++n;
+	}
+	return n;
+#endif
+}
+
+static inline int highest_bit(unsigned int x)
+{
+#ifdef __GNUC__
+	return 31 - __builtin_clz(x);
+#else
+	int n = 0;
+	while(x >>= 1)
+		++n;
+	return n;
+#endif
+}
+
+//
+// DataScanner
+//
+
+DataScanner::DataScanner(unsigned int max_line)
+: m_max_line(max_line),
+m_last_lf(0)
+{
+	reset();
+}
+
+void DataScanner::reset()
+{
+	m_line_len = 0;
+	m_too_long = false;
+
+	// The text starts at the beginning of a line.
+	m_tail[0] = CR;
+	m_tail[1] = LF;
+}
+
+long DataScanner::block(long i, unsigned int lf, unsigned int lfdot)
+{
+	long dot = -1;
+
+	if(lfdot)
+	{
+		int j = lowest_bit(lfdot);
+		dot = i + j + 1;
+
+		// Only the LFs up to this one have been looked at.
+		if(j < 31)
+			lf &= (2u << j) - 1;
+	}
+
+	// Lines that start and end inside the block are too short to matter, so
+	// only the first LF ends a line that could be too long.
+	if(i + lowest_bit(lf) - m_last_lf > (long)m_max_line)
+		m_too_long = true;
+
+	m_last_lf = i + highest_bit(lf);
+
+	return dot;
+}
+
+long DataScanner::findDotLine(const char* buf, unsigned int from, unsigned int len)
+{
+	unsigned int i = from;
+
+	for(;;)
+	{
+		unsigned int lf, lfdot;
+		unsigned int j = next_block(buf, i, len, &lf, &lfdot);
+
+		if(lf == 0)
+		{
+			i = j;
+			break;
+		}
+
+		long dot = block(j, lf, lfdot);
+		if(dot >= 0)
+			return dot;
+
+		i = j + 32;
+	}
+
+	// Less than a block is left, so look at it a byte at a time.
+	for(; i < len; ++i)
+	{
+		if(buf[i] != LF)
+			continue;
+
+		if((long)i - m_last_lf > (long)m_max_line)
+			m_too_long = true;
+
+		m_last_lf = i;
+
+		if(i + 1 < len && buf[i + 1] == '.')
+			return i + 1;
+	}
+
+	// The line in progress is already too long, wherever it ends.
+	if((long)len - m_last_lf > (long)m_max_line)
+		m_too_long = true;
+
+	return -1;
+}
+
+unsigned int DataScanner::scan(const char* buf, unsigned int len, bool* pend)
+{
+	unsigned int used = len;
+	*pend = false;
+
+	// Offsets are relative to buf, so the line in progress started before it.
+	m_last_lf = -(long)m_line_len - 1;
+
+	// A '.' right at the start follows the LF at the end of the last buffer.
+	long dot = len > 0 && m_tail[1] == LF && buf[0] == '.' ? 0 : findDotLine(buf, 0, len);
+
+	while(dot >= 0)
+	{
+		// Wait for the rest of the line to see if it's the last.
+		if((unsigned int)dot + 2 >= len)
+		{
+			used = dot;
+			break;
+		}
+
+		char before = dot >= 2 ? buf[dot - 2] : (dot == 1 ? m_tail[1] : m_tail[0]);
+
+		if(before == CR && buf[dot + 1] == CR && buf[dot + 2] == LF)
+		{
+			used = dot;
+			*pend = true;
+			break;
+		}
+
+		dot = findDotLine(buf, dot + 1, len);
+	}
+
+	// Carry the line in progress and the last two bytes over to the next buffer.
+	long line_len = (long)used - (m_last_lf + 1);
+	m_line_len = line_len > (long)m_max_line ? m_max_line + 1 : (unsigned int)line_len;
+
+	if(used >= 2)
+	{
+		m_tail[0] = buf[used - 2];
+		m_tail[1] = buf[used - 1];
+	}
+	else if(used == 1)
+	{
+		m_tail[0] = m_tail[1];
+		m_tail[1] = buf[0];
+	}
+
+	return used;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+// data_scanner.h - find the end of the text sent after DATA a whole buffer at
+// a time. On x86 the buffer is searched 32 bytes at a time with SSE2, or AVX2
+// where the processor has it, instead of being split into lines.
+
+#ifndef MAILSERV_DATA_SCANNER_H
+#define MAILSERV_DATA_SCANNER_H
+
+// DataScanner looks through the text for the line holding just a '.' that
+// ends it. Only lines that start with a '.' need a closer look, so it searches
+// for LFs followed by a '.' and otherwise only notes where the LFs are, to
+// check the line length. The text is left as it is, dot-stuffing included.
+class DataScanner
+{
+	unsigned int m_max_line; // The longest line allowed, including the CRLF.
+	unsigned int m_line_len; // The length of the line in progress at the end of the last buffer.
+	bool m_too_long; // True once a line longer than m_max_line has been seen.
+	char m_tail[2]; // The last two bytes of text before the next buffer.
+	long m_last_lf; // The offset of the last LF seen in the buffer being scanned. May be negative.
+
+	// Returns the offset of the first '.' after an LF in buf[from, len), or -1
+	// if there is none. Notes the LFs before it.
+	long findDotLine(const char* buf, unsigned int from, unsigned int len);
+
+	// Note the LFs in the 32 byte block at offset i of the buffer. lf has a bit
+	// set for each LF and lfdot a bit for each LF followed by a '.'. Returns the
+	// offset of the first such '.', or -1 if there is none.
+	long block(long i, unsigned int lf, unsigned int lfdot);
+
+public:
+	// max_line must be at least 32.
+	DataScanner(unsigned int max_line);
+
+	// Start a new text.
+	void reset();
+
+	// Scan the next len bytes of the text. Returns how many of them are text.
+	// If the terminating line was found *pend is set to true and it starts at
+	// the returned offset. Otherwise the bytes that aren't text yet start a
+	// line with a '.' and more must be received to tell if it's the last one.
+	unsigned int scan(const char* buf, unsigned int len, bool* pend);
+
+	// True if the text had a line longer than max_line.
+	bool tooLong() const { return m_too_long; }
+};
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "file_map.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+FileMap::FileMap()
+: m_map(0),
+m_map_len(0),
+m_buf(0),
+m_data(0),
+m_len(0)
+{
+}
+
+FileMap::~FileMap()
+{
+	close();
+}
+
+bool FileMap::open(FILE* fp, long offset)
+{
+	close();
+
+	struct stat st;
+	if(offset < 0 || fstat(fileno(fp), &st) != 0 || st.st_size < offset)
+		return false;
+
+	m_len = (size_t)(st.st_size - offset);
+	if(m_len == 0)
+	{
+		m_data = "";
+		return true;
+	}
+
+#ifndef WIN32
+	// mmap wants an offset on a page boundary.
+	long page = sysconf(_SC_PAGESIZE);
+	long start = page > 0 ? offset - offset % page : 0;
+
+	m_map_len = m_len + (offset - start);
+	m_map = mmap(0, m_map_len, PROT_READ, MAP_PRIVATE, fileno(fp), start);
+
+	if(m_map != MAP_FAILED)
+	{
+#ifdef MADV_SEQUENTIAL
+		madvise(m_map, m_map_len, MADV_SEQUENTIAL);
+#endif
+		m_data = (const char*)m_map + (offset - start);
+		return true;
+	}
+
+	m_map = 0;
+	m_map_len = 0;
+#endif
+
+	m_buf = new char[m_len];
+
+	if(fseek(fp, offset, SEEK_SET) != 0 || fread(m_buf, 1, m_len, fp) != m_len)
+	{
+		close();
+		return false;
+	}
+
+	m_data = m_buf;
+	return true;
+}
+
+void FileMap::close()
+{
+#ifndef WIN32
+	if(m_map)
+		munmap(m_map, m_map_len);
+#endif
+
+	delete[] m_buf;
+
+	m_map = 0;
+	m_map_len = 0;
+	m_buf = 0;
+	m_data = 0;
+	m_len = 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+// file_map.h - read-only access to part of a file in memory.
+
+#ifndef MAILSERV_FILE_MAP_H
+#define MAILSERV_FILE_MAP_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// FileMap maps the end of a file into memory, so it can be read from storage
+// once and then used as often as needed. Where the file can't be mapped
+// (including on Windows) it is read into a buffer instead.
+class FileMap
+{
+	void *m_map; // What was mapped, which starts at a page boundary.
+	size_t m_map_len;
+	char *m_buf; // What was read, if it couldn't be mapped.
+	const char *m_data;
+	size_t m_len;
+
+	// Not copyable. These have no definition.
+	FileMap(const FileMap &);
+	const FileMap & operator=(const FileMap &);
+
+public:
+	FileMap();
+	~FileMap();
+
+	// Map fp from offset to the end of the file. The pages are read in order,
+	// so the kernel is told to read ahead. Returns false on error.
+	bool open(FILE* fp, long offset);
+
+	void close();
+
+	const char* data() const { return m_data; }
+	size_t size() const { return m_len; }
+};
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "io_ring.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// The C library doesn't wrap the io_uring system calls.
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// The number of opcodes there is room for in a probe.
+#define PROBE_OPS 256
+
+// Returns true if the ring fd can do plain reads and writes. Kernels before
+// 5.6 create rings but fail those with EINVAL, and they don't know
+// IORING_REGISTER_PROBE either.
+static bool supports_read_write(int fd)
+{
+	size_t size = sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = (struct io_uring_probe*)new char[size];
+	memset(probe, 0, size);
+
+	bool rc = io_uring_register(fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == 0 &&
+		probe->ops_len > IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		probe->ops_len > IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+	delete[] (char*)probe;
+	return rc;
+}
+
+// The ring indexes are shared with the kernel, so reads and writes of them
+// must be ordered with the reads and writes of the entries they cover.
+#define ring_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Set once a ring can't be created, so the other threads don't keep trying.
+static volatile bool s_unsupported = false;
+
+// Each thread's ring, created by threadRing. It is also kept under
+// s_ring_key, whose destructor frees it when the thread exits.
+static __thread IoRing *s_thread_ring = 0;
+static pthread_key_t s_ring_key;
+static pthread_once_t s_ring_key_once = PTHREAD_ONCE_INIT;
+
+static void delete_thread_ring(void* ring)
+{
+	delete (IoRing*)ring;
+}
+
+static void create_ring_key()
+{
+	pthread_key_create(&s_ring_key, delete_thread_ring);
+}
+
+// How many operations each thread's ring can have in flight.
+#define THREAD_RING_ENTRIES 32
+#endif
+
+//
+// IoRing
+//
+
+IoRing::IoRing()
+#ifdef HAVE_IO_URING
+: m_fd(-1),
+m_sq_ring(MAP_FAILED),
+m_sq_ring_size(0),
+m_cq_ring(MAP_FAILED),
+m_cq_ring_size(0),
+m_sqes((struct io_uring_sqe*)MAP_FAILED),
+m_sqes_size(0),
+m_sq_entries(0),
+m_queued(0)
+#endif
+{
+}
+
+IoRing::~IoRing()
+{
+#ifdef HAVE_IO_URING
+	if(m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqes_size);
+	if(m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+		munmap(m_cq_ring, m_cq_ring_size);
+	if(m_sq_ring != MAP_FAILED)
+		munmap(m_sq_ring, m_sq_ring_size);
+	if(m_fd != -1)
+		close(m_fd);
+#endif
+}
+
+bool IoRing::open(unsigned int entries)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_params params;
+	memset(&params, 0, sizeof params);
+
+	m_fd = io_uring_setup(entries, &params);
+	if(m_fd < 0)
+	{
+		m_log.log(LOG_WARN, "IoRing::open(): io_uring is not available (errno %d).", errno);
+		m_fd = -1;
+		return false;
+	}
+
+	if(!supports_read_write(m_fd))
+	{
+		m_log.log(LOG_WARN, "IoRing::open(): io_uring can't read and write files on this kernel.");
+		return false;
+	}
+
+	m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels let both rings share one mapping.
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(m_cq_ring_size > m_sq_ring_size)
+			m_sq_ring_size = m_cq_ring_size;
+		m_cq_ring_size = m_sq_ring_size;
+	}
+
+	m_sq_ring = mmap(0, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if(m_sq_ring == MAP_FAILED)
+	{
+		m_log.log(LOG_ERROR, "IoRing::open(): Could not map the submission ring.");
+		return false;
+	}
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		m_cq_ring = m_sq_ring;
+	else
+	{
+		m_cq_ring = mmap(0, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if(m_cq_ring == MAP_FAILED)
+		{
+			m_log.log(LOG_ERROR, "IoRing::open(): Could not map the completion ring.");
+			return false;
+		}
+	}
+
+	m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = (struct io_uring_sqe*)mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if(m_sqes == MAP_FAILED)
+	{
+		m_log.log(LOG_ERROR, "IoRing::open(): Could not map the submission queue entries.");
+		return false;
+	}
+
+	char *sq = (char*)m_sq_ring;
+	m_sq_head = (unsigned*)(sq + params.sq_off.head);
+	m_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	m_sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	m_sq_array = (unsigned*)(sq + params.sq_off.array);
+	m_sq_entries = params.sq_entries;
+
+	char *cq = (char*)m_cq_ring;
+	m_cq_head = (unsigned*)(cq + params.cq_off.head);
+	m_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	m_cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	m_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+struct io_uring_sqe* IoRing::nextEntry()
+{
+	unsigned tail = *m_sq_tail + m_queued;
+
+	if(tail - ring_load(m_sq_head) >= m_sq_entries)
+		return 0;
+
+	unsigned index = tail & *m_sq_mask;
+	struct io_uring_sqe *sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof *sqe);
+	m_sq_array[index] = index;
+	++m_queued;
+
+	return sqe;
+}
+#endif
+
+bool IoRing::queueRead(int fd, void* buf, unsigned int len, long long offset, unsigned long long tag)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_sqe *sqe = nextEntry();
+	if(!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = tag;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool IoRing::queueWrite(int fd, const void* buf, unsigned int len, long long offset, unsigned long long tag)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_sqe *sqe = nextEntry();
+	if(!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = tag;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool IoRing::submit()
+{
+#ifdef HAVE_IO_URING
+	if(m_queued == 0)
+		return true;
+
+	// Publish the new entries to the kernel before telling it about them.
+	ring_store(m_sq_tail, *m_sq_tail + m_queued);
+
+	unsigned to_submit = m_queued;
+	m_queued = 0;
+
+	while(to_submit > 0)
+	{
+		int rc = io_uring_enter(m_fd, to_submit, 0, 0);
+		if(rc < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			m_log.log(LOG_ERROR, "IoRing::submit(): io_uring_enter failed (errno %d).", errno);
+			return false;
+		}
+		to_submit -= rc;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool IoRing::wait(IoCompletion* completion)
+{
+#ifdef HAVE_IO_URING
+	for(;;)
+	{
+		unsigned head = *m_cq_head;
+
+		if(head != ring_load(m_cq_tail))
+		{
+			struct io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+			completion->tag = cqe->user_data;
+			completion->result = cqe->res;
+			ring_store(m_cq_head, head + 1);
+			return true;
+		}
+
+		if(io_uring_enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+		{
+			m_log.log(LOG_ERROR, "IoRing::wait(): io_uring_enter failed (errno %d).", errno);
+			return false;
+		}
+	}
+#else
+	return false;
+#endif
+}
+
+int IoRing::write(int fd, const void* buf, unsigned int len, long long offset)
+{
+	IoCompletion c;
+
+	if(!queueWrite(fd, buf, len, offset, 0) || !submit() || !wait(&c))
+		return -1;
+
+	if(c.result < 0)
+	{
+		m_log.log(LOG_WARN, "IoRing::write(): Write failed (errno %d).", -c.result);
+		return -1;
+	}
+
+	return c.result;
+}
+
+IoRing* IoRing::threadRing()
+{
+#ifdef HAVE_IO_URING
+	if(s_thread_ring == 0 && !s_unsupported)
+	{
+		pthread_once(&s_ring_key_once, create_ring_key);
+
+		IoRing *ring = new IoRing;
+		if(ring->open(THREAD_RING_ENTRIES))
+		{
+			s_thread_ring = ring;
+			pthread_setspecific(s_ring_key, ring);
+		}
+		else
+		{
+			s_unsupported = true;
+			delete ring;
+		}
+	}
+
+	return s_thread_ring;
+#else
+	return 0;
+#endif
+}
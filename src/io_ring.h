@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+// io_ring.h - batched file I/O through the Linux io_uring interface. Reads and
+// writes are queued in the submission ring and handed to the kernel together
+// with a single system call. Where io_uring isn't available (other platforms,
+// old kernel headers, or a kernel that refuses to create a ring or can't read
+// and write files with one) the caller falls back to ordinary reads and
+// writes.
+
+#ifndef MAILSERV_IO_RING_H
+#define MAILSERV_IO_RING_H
+
+#include "log.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+// A finished operation.
+struct IoCompletion
+{
+	unsigned long long tag; // The tag the operation was queued with.
+	int result; // The number of bytes transferred, or -errno on failure.
+};
+
+class IoRing
+{
+	Log m_log;
+
+#ifdef HAVE_IO_URING
+	int m_fd; // The io_uring instance.
+
+	void *m_sq_ring; // The mapped submission ring and its size.
+	size_t m_sq_ring_size;
+	void *m_cq_ring; // The mapped completion ring and its size. May be the same mapping as m_sq_ring.
+	size_t m_cq_ring_size;
+	struct io_uring_sqe *m_sqes; // The submission queue entries and their size.
+	size_t m_sqes_size;
+
+	// Pointers into the mapped rings.
+	unsigned *m_sq_head;
+	unsigned *m_sq_tail;
+	unsigned *m_sq_mask;
+	unsigned *m_sq_array;
+	unsigned *m_cq_head;
+	unsigned *m_cq_tail;
+	unsigned *m_cq_mask;
+	struct io_uring_cqe *m_cqes;
+
+	unsigned m_sq_entries;
+	unsigned m_queued; // Entries queued since the last submit.
+
+	// Get the next free submission queue entry, or NULL if the ring is full.
+	struct io_uring_sqe* nextEntry();
+#endif
+
+	// The assignment operator is made private so that no one uses it. It has no definition.
+	IoRing(const IoRing &);
+	const IoRing & operator=(const IoRing &);
+
+public:
+	IoRing();
+	~IoRing();
+
+	// Create a ring with room for entries operations in flight. Returns false
+	// if io_uring isn't supported, or the kernel can't read and write files
+	// through it.
+	bool open(unsigned int entries);
+
+	// Queue a read or write of len bytes at offset. Nothing happens until
+	// submit is called. Returns false if the submission ring is full.
+	bool queueRead(int fd, void* buf, unsigned int len, long long offset, unsigned long long tag);
+	bool queueWrite(int fd, const void* buf, unsigned int len, long long offset, unsigned long long tag);
+
+	// Hand everything queued to the kernel. Returns false on error.
+	bool submit();
+
+	// Get the next finished operation, waiting for one if none have finished
+	// yet. Returns false on error.
+	bool wait(IoCompletion* completion);
+
+	// Write len bytes at offset and wait for it to finish. Returns the number of
+	// bytes written, which may be less than len, or -1 on error.
+	int write(int fd, const void* buf, unsigned int len, long long offset);
+
+	// Rings may only be used by one thread at a time. This returns a ring for
+	// the calling thread, creating it the first time, or NULL if io_uring isn't
+	// supported. The ring is freed when the thread exits.
+	static IoRing* threadRing();
+};
+
+#endif
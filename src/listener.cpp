@@ -34,16 +34,25 @@
 #include "http_monitor.h"
 #include "thread.h"
 
+#ifndef WIN32
+#include <errno.h>
+#endif
+
 struct StartupData
 {
 	SOCKET sock;
 	Accounts & accounts;
 	const Options & options;
+	ListenerShard *shard;
+	StartupData *prev, *next; // The shard's other POP3 and HTTP sessions.
 
-	StartupData(SOCKET s, Accounts & accnts, const Options & opt)
+	StartupData(SOCKET s, Accounts & accnts, const Options & opt, ListenerShard *shrd)
 		: sock(s),
 		accounts(accnts),
-		options(opt)
+		options(opt),
+		shard(shrd),
+		prev(0),
+		next(0)
 	{
 	}
 
@@ -51,45 +60,548 @@ private:
 	const StartupData & operator=(const StartupData &);
 };
 
-static THREAD_RETTYPE WINAPI run_smpt_server(void *pData)
+// An SMTP session waiting in a shard's reactor or running on one of its worker threads.
+struct SmtpSession
 {
-	StartupData *pSD = (StartupData*)pData;
-	Server server(pSD->sock, pSD->accounts, pSD->options);
-	delete pSD; // pSD was allocated by a listener routine.
+	ListenerShard::REACTOR_TARGET target; // Always RT_SMTP_SESSION.
+	ListenerShard *shard;
+	SOCKET sock;
+	bool registered; // True once sock has been added to the reactor.
+	SmtpSession *prev, *next; // The shard's other sessions waiting in the reactor.
+	Server server;
+
+	SmtpSession(ListenerShard *s, SOCKET sck, Accounts & accounts, const Options & options, Sender & sender)
+		: target(ListenerShard::RT_SMTP_SESSION),
+		shard(s),
+		sock(sck),
+		registered(false),
+		prev(0),
+		next(0),
+		server(sck, accounts, options, sender)
+	{
+	}
+
+private:
+	const SmtpSession & operator=(const SmtpSession &);
+};
 
-	return (THREAD_RETTYPE)server.run();
+static THREAD_RETTYPE WINAPI run_listener_shard(void *pData);
+
+// Create a socket listening on port on all interfaces. The socket is
+// non-blocking since the reactor reports it edge-triggered. If reuseport is
+// true other sockets may listen on the same port. Returns INVALID_SOCKET on error.
+static SOCKET open_listen_socket(short port, bool reuseport)
+{
+	SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+
+	if(s == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	if(reuseport)
+	{
+#ifdef SO_REUSEPORT
+		int on = 1;
+		if(setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof on) != 0)
+#endif
+		{
+			closesocket(s);
+			return INVALID_SOCKET;
+		}
+	}
+
+	sockaddr_in listen_addr;
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_port = htons(port);
+	listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if(bind(s, (sockaddr*)&listen_addr, sizeof listen_addr) != 0 ||
+		listen(s, SOMAXCONN) != 0 ||
+		!set_nonblocking(s, true))
+	{
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	return s;
 }
 
-static THREAD_RETTYPE WINAPI run_sender(void *pData)
+//
+// ListenerShard
+//
+
+ListenerShard::ListenerShard(const Options & opts, Accounts & accounts, SpoolCommitter & committer,
+							 Sender & sender, unsigned int index, unsigned int shard_count)
+: m_options(opts),
+m_accounts(accounts),
+m_committer(committer),
+m_sender(sender),
+m_index(index),
+m_shard_count(shard_count),
+m_run(true),
+m_blocking(0),
+m_waiting(0),
+m_bListMutexCreated(false)
+{
+	if(create_mutex(m_list_mutex))
+		m_bListMutexCreated = true;
+}
+
+ListenerShard::~ListenerShard()
 {
-	Sender *p = (Sender*)pData;
-	p->Run();
-	delete p;
+	if(m_bListMutexCreated)
+		delete_mutex(m_list_mutex);
+}
+
+int ListenerShard::Run()
+{
+	// Pin this thread before starting the session threads so that they
+	// inherit the same CPU.
+	if(m_options.pinListenerShards())
+	{
+		unsigned int cpu = m_index % cpu_count();
+		if(!set_thread_cpu(cpu))
+			m_log.log(LOG_WARN, "ListenerShard::Run(): Could not pin listener shard %u to CPU %u.", m_index, cpu);
+	}
+
+	if(!m_bListMutexCreated)
+	{
+		m_log.log(LOG_ERROR, "ListenerShard::Run(): Could not create the session list mutex for shard %u.", m_index);
+		return 1;
+	}
+
+	if(!m_sessions.start(m_options.sessionThreads(), m_options.sessionQueueLength()))
+	{
+		m_log.log(LOG_ERROR, "ListenerShard::Run(): Could not start the session worker threads for shard %u.", m_index);
+		return 1;
+	}
+
+	if(!m_reactor.open())
+	{
+		m_log.log(LOG_ERROR, "ListenerShard::Run(): Could not create the event reactor for shard %u.", m_index);
+		m_sessions.stop();
+		return 1;
+	}
+
+	ListenSocket listen_sockets[] = {
+		{ RT_LISTEN_SOCKET, INVALID_SOCKET, "SMTP", NULL,
+			"421 Service not available, closing transmission channel" },
+		{ RT_LISTEN_SOCKET, INVALID_SOCKET, "POP3", pop3_session_routine,
+			"-ERR Server busy, try again later" },
+		{ RT_LISTEN_SOCKET, INVALID_SOCKET, "HTTP", http_session_routine,
+			"HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n" }
+	};
+	short ports[] = {
+		m_options.smtpListenPort(),
+		m_options.pop3ListenPort(),
+		m_options.httpListenPort()
+	};
+
+	// Only the first shard runs the http monitor.
+	const int listen_count = m_index == 0 && m_options.useHttpMonitor() ? 3 : 2;
+	const bool reuseport = m_shard_count > 1;
+	int rc = 0;
+	int i;
+
+	// Setup the listening sockets.
+	for(i = 0; i < listen_count && rc == 0; ++i)
+	{
+		ListenSocket & ls = listen_sockets[i];
+		ls.sock = open_listen_socket(ports[i], reuseport && i < 2);
+
+		if(ls.sock == INVALID_SOCKET)
+		{
+			m_log.log(LOG_ERROR, "ListenerShard::Run(): Could not create %s listen socket on port %d for shard %u.", ls.name, ports[i], m_index);
+			rc = 1;
+		}
+		else if(!m_reactor.add(ls.sock, REACTOR_READ, &ls))
+		{
+			m_log.log(LOG_ERROR, "ListenerShard::Run(): Could not add %s listen socket to the event reactor for shard %u.", ls.name, m_index);
+			rc = 1;
+		}
+	}
+
+	while(m_run && rc == 0)
+	{
+		ReactorEvent events[16];
+		int ready = m_reactor.wait(events, sizeof(events) / sizeof(events[0]), -1);
+
+		if(ready < 0)
+		{
+			m_log.log(LOG_ERROR, "ListenerShard::Run(): Error waiting for connections.");
+			rc = 1;
+			break;
+		}
+
+		// ready is 0 when Stop woke us up or a signal interrupted the wait.
+		for(i = 0; i < ready && m_run; ++i)
+		{
+			switch(*(REACTOR_TARGET*)events[i].data)
+			{
+			case RT_LISTEN_SOCKET:
+				acceptConnections(*(ListenSocket*)events[i].data);
+				break;
+
+			case RT_SMTP_SESSION:
+				// The session's socket is registered one-shot, so the reactor won't
+				// report it again until the session has run and re-armed it.
+				removeWaitingSession((SmtpSession*)events[i].data);
+				m_sessions.submit(smtp_session_routine, discard_smtp_session, events[i].data, true);
+				break;
+			}
+		}
+	}
+
+	// The POP3 and HTTP sessions would otherwise keep their threads until
+	// their clients leave, and stop waits for the threads.
+	endBlockingSessions();
+	m_sessions.stop();
+	deleteWaitingSessions();
+
+	for(i = 0; i < listen_count; ++i)
+	{
+		if(listen_sockets[i].sock != INVALID_SOCKET)
+		{
+			m_reactor.remove(listen_sockets[i].sock);
+			closesocket(listen_sockets[i].sock);
+		}
+	}
+
+	return rc;
+}
+
+void ListenerShard::acceptConnections(const ListenSocket & ls)
+{
+	// The reactor only tells us when new connections arrive, not that some
+	// are still waiting, so accept until there are none left.
+	for(;;)
+	{
+		sockaddr_in addr;
+		socklen_t addr_len = sizeof addr;
+		SOCKET sock = accept(ls.sock, (sockaddr*)&addr, &addr_len);
+
+		if(sock == INVALID_SOCKET)
+		{
+			if(socket_would_block())
+				break;
+
+#ifndef WIN32
+			// The connection went away before we got to it or we were interrupted by
+			// a signal. Either way there may be more connections waiting.
+			if(errno == ECONNABORTED || errno == EINTR)
+				continue;
+#endif
+
+			m_log.log(LOG_WARN, "ListenerShard::acceptConnections(): Error accepting %s connection.", ls.name);
+			break;
+		}
+
+		bool started;
+
+		if(ls.session_routine)
+		{
+#ifndef __linux__
+			// Some platforms pass the listening socket's non-blocking mode on to
+			// accepted sockets. The session routines expect blocking sockets.
+			set_nonblocking(sock, false);
+#endif
+
+			// pSD will be freed by the session routine.
+			StartupData *pSD = new StartupData(sock, m_accounts, m_options, this);
+			addBlockingSession(pSD);
+
+			started = m_sessions.submit(ls.session_routine, discard_blocking_session, pSD);
+			if(!started)
+			{
+				removeBlockingSession(pSD);
+				delete pSD;
+			}
+		}
+		else
+			started = startSmtpSession(sock);
+
+		if(!started)
+		{
+			m_log.log(LOG_WARN, "ListenerShard::acceptConnections(): Too many %s sessions waiting. Connection refused.", ls.name);
+
+			// The reply is short enough to fit in the socket's send buffer, so
+			// this won't block.
+			Socket s(sock);
+			try
+			{
+				s.putLine(ls.busy_reply);
+			}
+			catch(SocketError &)
+			{
+			}
+			s.close();
+		}
+	}
+}
+
+bool ListenerShard::startSmtpSession(SOCKET sock)
+{
+	if(!set_nonblocking(sock, true))
+	{
+		m_log.log(LOG_WARN, "ListenerShard::startSmtpSession(): Could not make SMTP socket non-blocking.");
+		closesocket(sock);
+		return true;
+	}
+
+	// The first run of the session sends the greeting. The session adds its
+	// socket to the reactor when it needs to wait.
+	SmtpSession *session = new SmtpSession(this, sock, m_accounts, m_options, m_sender);
+
+	if(m_sessions.submit(smtp_session_routine, discard_smtp_session, session))
+		return true;
+
+	// Let the caller send the busy reply on the socket instead.
+	session->server.detach();
+	delete session;
+	return false;
+}
+
+THREAD_RETTYPE WINAPI ListenerShard::smtp_session_routine(void* pData)
+{
+	SmtpSession *session = (SmtpSession*)pData;
+	session->shard->resumeSmtpSession(session);
 
 	return 0;
 }
 
-static THREAD_RETTYPE WINAPI run_pop3_server(void *pData)
+void ListenerShard::smtp_commit_done(void* pData)
+{
+	SmtpSession *session = (SmtpSession*)pData;
+	ListenerShard *shard = session->shard;
+
+	if(shard->m_sessions.submit(smtp_session_routine, discard_smtp_session, session, true))
+		return;
+
+	// The shard is shutting down.
+	discard_smtp_session(session);
+}
+
+void ListenerShard::discard_smtp_session(void* pData)
+{
+	SmtpSession *session = (SmtpSession*)pData;
+
+	if(session->registered)
+		session->shard->m_reactor.remove(session->sock);
+	delete session;
+}
+
+void ListenerShard::discard_blocking_session(void* pData)
+{
+	StartupData *pSD = (StartupData*)pData;
+
+	pSD->shard->removeBlockingSession(pSD);
+	closesocket(pSD->sock);
+	delete pSD;
+}
+
+THREAD_RETTYPE WINAPI ListenerShard::pop3_session_routine(void* pData)
 {
 	StartupData *pSD = (StartupData*)pData;
 	Pop3Server server(pSD->sock, pSD->accounts, pSD->options);
+	THREAD_RETTYPE rc = (THREAD_RETTYPE)server.run();
+
+	// server closes the socket when it goes, which is after this.
+	pSD->shard->removeBlockingSession(pSD);
 	delete pSD;
 
-	return (THREAD_RETTYPE)server.run();
+	return rc;
 }
 
-static THREAD_RETTYPE WINAPI run_http_server(void *pData)
+THREAD_RETTYPE WINAPI ListenerShard::http_session_routine(void* pData)
 {
 	StartupData *pSD = (StartupData*)pData;
 	HttpMonitor server(pSD->sock, pSD->accounts, pSD->options);
+	THREAD_RETTYPE rc = (THREAD_RETTYPE)server.run();
+
+	// server closes the socket when it goes, which is after this.
+	pSD->shard->removeBlockingSession(pSD);
+	delete pSD;
+
+	return rc;
+}
+
+void ListenerShard::addBlockingSession(StartupData* pSD)
+{
+	// If the mutex fails the session just isn't ended early at shutdown.
+	if(!wait_mutex(m_list_mutex))
+		return;
+
+	pSD->prev = 0;
+	pSD->next = m_blocking;
+	if(m_blocking)
+		m_blocking->prev = pSD;
+	m_blocking = pSD;
+
+	release_mutex(m_list_mutex);
+}
+
+void ListenerShard::removeBlockingSession(StartupData* pSD)
+{
+	if(!wait_mutex(m_list_mutex))
+		return;
+
+	// It isn't in the list if addBlockingSession couldn't add it.
+	if(pSD->prev)
+		pSD->prev->next = pSD->next;
+	else if(m_blocking == pSD)
+		m_blocking = pSD->next;
+	if(pSD->next)
+		pSD->next->prev = pSD->prev;
+	pSD->prev = pSD->next = 0;
+
+	release_mutex(m_list_mutex);
+}
+
+void ListenerShard::endBlockingSessions()
+{
+	if(!wait_mutex(m_list_mutex))
+		return;
+
+	// Only stop receiving, so a session in the middle of sending something
+	// finishes it and then finds its client gone.
+	for(StartupData *pSD = m_blocking; pSD; pSD = pSD->next)
+		::shutdown(pSD->sock, 0);
+
+	release_mutex(m_list_mutex);
+}
+
+void ListenerShard::resumeSmtpSession(SmtpSession *session)
+{
+	unsigned int events = REACTOR_ONESHOT;
+
+	switch(session->server.resume())
+	{
+	case Server::RS_WANT_READ:
+		events |= REACTOR_READ;
+		break;
+
+	case Server::RS_WANT_WRITE:
+		events |= REACTOR_WRITE;
+		break;
+
+	case Server::RS_WANT_COMMIT:
+		// The socket stays disarmed until smtp_commit_done resumes the
+		// session, which may be straight away on the committer thread.
+		session->server.commitSpool(m_committer, smtp_commit_done, session);
+		return;
+
+	case Server::RS_DONE:
+		break;
+	}
+
+	if(events != REACTOR_ONESHOT)
+	{
+		// Once the socket is armed another worker thread may pick the session
+		// up, so it must not be touched after this.
+		addWaitingSession(session);
+
+		if(session->registered)
+		{
+			if(m_reactor.modify(session->sock, events, session))
+				return;
+		}
+		else
+		{
+			session->registered = true;
+			if(m_reactor.add(session->sock, events, session))
+				return;
+		}
+
+		removeWaitingSession(session);
+		m_log.log(LOG_WARN, "ListenerShard::resumeSmtpSession(): Could not add SMTP session to the event reactor.");
+	}
+
+	if(session->registered)
+		m_reactor.remove(session->sock);
+	delete session;
+}
+
+void ListenerShard::addWaitingSession(SmtpSession* session)
+{
+	// If the mutex fails the session is just left for the process exit to clean up.
+	if(!wait_mutex(m_list_mutex))
+		return;
+
+	session->prev = 0;
+	session->next = m_waiting;
+	if(m_waiting)
+		m_waiting->prev = session;
+	m_waiting = session;
+
+	release_mutex(m_list_mutex);
+}
+
+void ListenerShard::removeWaitingSession(SmtpSession* session)
+{
+	if(!wait_mutex(m_list_mutex))
+		return;
+
+	// It isn't in the list if addWaitingSession couldn't add it.
+	if(session->prev)
+		session->prev->next = session->next;
+	else if(m_waiting == session)
+		m_waiting = session->next;
+	if(session->next)
+		session->next->prev = session->prev;
+	session->prev = session->next = 0;
+
+	release_mutex(m_list_mutex);
+}
+
+void ListenerShard::deleteWaitingSessions()
+{
+	if(!wait_mutex(m_list_mutex))
+		return;
+
+	while(m_waiting)
+	{
+		SmtpSession *session = m_waiting;
+		m_waiting = session->next;
+
+		m_reactor.remove(session->sock);
+		delete session;
+	}
+
+	release_mutex(m_list_mutex);
+}
+
+void ListenerShard::Stop()
+{
+	m_run = false;
+	m_reactor.wakeup();
+}
+
+//
+// Listener
+//
+
+struct ShardStartupData
+{
+	ListenerShard *shard;
+	SEMAPHORE *exited; // Signaled when the shard returns.
+};
+
+static THREAD_RETTYPE WINAPI run_listener_shard(void *pData)
+{
+	ShardStartupData *pSD = (ShardStartupData*)pData;
+	THREAD_RETTYPE rc = (THREAD_RETTYPE)pSD->shard->Run();
+	signal_semaphore(*pSD->exited);
 	delete pSD;
 
-	return (THREAD_RETTYPE)server.run();
+	return rc;
 }
 
 Listener::Listener(const Options & opts)
 : m_options(opts),
+m_committer(opts),
 m_pSender(0),
+m_shards(0),
+m_shard_count(0),
+m_bShardExitSemCreated(false),
 m_run(true)
 {
 #ifdef WIN32
@@ -103,247 +615,119 @@ m_run(true)
 
 Listener::~Listener()
 {
+	// In case Run returned early. The committer calls back into the shards,
+	// and the sessions and the committer queue messages with the Sender, so
+	// it goes last.
+	m_committer.stop();
+
+	for(unsigned int i = 0; i < m_shard_count; ++i)
+		delete m_shards[i];
+	delete[] m_shards;
+
 	if(m_pSender)
 	{
 		m_pSender->Stop();
 		delete m_pSender;
 	}
 
+	if(m_bShardExitSemCreated)
+		delete_semaphore(m_shardExitSemaphore);
+
 #ifdef WIN32
 	WSACleanup();
 #endif
 }
 
-#ifdef WIN32
-// If you don't do this pragma then you can't compile with warning level 4
-// with MS VC++ because FD_SET is a macro that has a while(0) in it.
-#pragma warning(disable : 4127)
-#endif
-
 int Listener::Run()
 {
 	// Initialize the accounts.
 	for(const DomainList *pDL = m_options.domains(); pDL; pDL = pDL->next)
 		m_accounts.addDomain(pDL->domain, pDL->mailbox_dir);
+	m_accounts.setMailboxCacheTtl(m_options.mailboxCacheTtl());
 
-	// Startup the sender monitor.
+	// The SMTP sessions only need the committer if they sync spool files.
+	if(m_options.spoolSync() != SPOOL_SYNC_NONE && !m_committer.start())
+	{
+		m_log.log(LOG_ERROR, "Listener::Run(): Error starting the spool committer.");
+		return 1;
+	}
+
+	// Start the sender before the SMTP server can queue messages with it.
 	if(!m_pSender)
 	{
 		m_pSender = new Sender(m_options, m_accounts);
-		if(!create_thread(run_sender, m_pSender))
+		if(!m_pSender->Start())
 		{
 			delete m_pSender;
 			m_pSender = 0;
-			m_log.log(LOG_ERROR, "Listener::Run(): Error creating sender thread.");
+			m_log.log(LOG_ERROR, "Listener::Run(): Error starting the sender.");
 			return 1;
 		}
 	}
-	
-	// Setup the SMTP listening socket.
-	SOCKET smtp_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
 
-	if(smtp_listen_socket == INVALID_SOCKET)
-	{
-		m_log.log(LOG_ERROR, "Listener::Run(): Could not create SMTP listen socket.");
-		return 1;
-	}
-
-	sockaddr_in listen_addr;
-	listen_addr.sin_family = AF_INET;
-	listen_addr.sin_port = htons(m_options.smtpListenPort());
-	listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(m_shards)
+		return 1; // Already running.
 
-	if(bind(smtp_listen_socket, (sockaddr*)&listen_addr, sizeof listen_addr) != 0)
+	if(create_semaphore(m_shardExitSemaphore))
+		m_bShardExitSemCreated = true;
+	else
 	{
-		m_log.log(LOG_ERROR, "Listener::Run(): Could not bind to address.");
-		closesocket(smtp_listen_socket);
+		m_log.log(LOG_ERROR, "Listener::Run(): Could not create shard exit semaphore.");
 		return 1;
 	}
 
-	if(listen(smtp_listen_socket, SOMAXCONN) != 0)
-	{
-		m_log.log(LOG_ERROR, "Listener::Run(): Could not set socket to listen socket.");
-		closesocket(smtp_listen_socket);
-		return 1;
-	}
-	
-	// Setup the POP3 listening socket.
-	SOCKET pop3_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+	// Create all of the shards before starting any so Stop sees all of them.
+	unsigned int count = m_options.listenerShards();
+	m_shards = new ListenerShard*[count];
+	for(unsigned int i = 0; i < count; ++i)
+		m_shards[i] = new ListenerShard(m_options, m_accounts, m_committer, *m_pSender, i, count);
+	m_shard_count = count;
 
-	if(pop3_listen_socket == INVALID_SOCKET)
+	// The first shard runs on this thread and the rest get their own.
+	unsigned int started = 0;
+	for(unsigned int i = 1; i < count && m_run; ++i)
 	{
-		m_log.log(LOG_ERROR, "Listener::Run(): Could not create POP3 listen socket.");
-		closesocket(smtp_listen_socket);
-		return 1;
-	}
-
-	listen_addr.sin_family = AF_INET;
-	listen_addr.sin_port = htons(m_options.pop3ListenPort());
-	listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-	if(bind(pop3_listen_socket, (sockaddr*)&listen_addr, sizeof listen_addr) != 0)
-	{
-		m_log.log(LOG_WARN, "Listener::Run(): Could not bind POP3 listen socket to address.");
-		closesocket(smtp_listen_socket);
-		closesocket(pop3_listen_socket);
-		return 1;
-	}
+		ShardStartupData *pSD = new ShardStartupData;
+		pSD->shard = m_shards[i];
+		pSD->exited = &m_shardExitSemaphore;
 
-	if(listen(pop3_listen_socket, SOMAXCONN) != 0)
-	{
-		m_log.log(LOG_WARN, "Listener::Run(): Could not set POP3 socket to listen socket.");
-		closesocket(smtp_listen_socket);
-		closesocket(pop3_listen_socket);
-		return 1;
-	}	
-
-	// Setup the HTML listening socket.
-	SOCKET http_listen_socket = INVALID_SOCKET;
-	if(m_options.useHttpMonitor())
-	{
-		http_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-
-		if(http_listen_socket == INVALID_SOCKET)
+		if(create_thread(run_listener_shard, pSD))
+			++started;
+		else
 		{
-			m_log.log(LOG_WARN, "Listener::Run(): Could not create HTTP listen socket.");
-			closesocket(smtp_listen_socket);
-			closesocket(pop3_listen_socket);
-			return 1;
-		}
-
-		listen_addr.sin_family = AF_INET;
-		listen_addr.sin_port = htons(m_options.httpListenPort());
-		listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-		if(bind(http_listen_socket, (sockaddr*)&listen_addr, sizeof listen_addr) != 0)
-		{
-			m_log.log(LOG_WARN, "Listener::Run(): Could not bind HTTP listen socket to address.");
-			closesocket(smtp_listen_socket);
-			closesocket(pop3_listen_socket);
-			closesocket(http_listen_socket);
-			return 1;
-		}
-
-		if(listen(http_listen_socket, SOMAXCONN) != 0)
-		{
-			m_log.log(LOG_WARN, "Listener::Run(): Could not set HTTP socket to listen socket.");
-			closesocket(smtp_listen_socket);
-			closesocket(pop3_listen_socket);
-			closesocket(http_listen_socket);
-			return 1;
+			m_log.log(LOG_ERROR, "Listener::Run(): Could not create thread for listener shard %u.", i);
+			delete pSD;
 		}
 	}
 
-	while(m_run)
-	{
-		int ready;
-		fd_set set;
-		FD_ZERO(&set);
-		FD_SET(smtp_listen_socket, &set);
-		FD_SET(pop3_listen_socket, &set);
-		if(m_options.useHttpMonitor())
-			FD_SET(http_listen_socket, &set);
-
-		ready = select(FD_SETSIZE, &set, NULL, NULL, NULL);
-
-		// This shouldn't happen since we have no timeout.
-		if(ready == 0)
-		{
-			m_log.log(LOG_WARN, "Listener::Run(): ready == 0. Doesn't make sense");
-			continue;
-		}
+	int rc = m_run ? m_shards[0]->Run() : 0;
 
-		// This will happen on signals or bad arguments to select.
-		if(ready <= 0)
-		{
-			// This is what I want to do but I don't know if I can in a
-			// multi-threaded application. I need to research this.
-			// if(errno != EINTR)
-			//	m_log.log("select failed: %s", strerror(errno));
-			continue;
-		}
-
-		if(FD_ISSET(smtp_listen_socket, &set))
-		{
-			sockaddr_in addr;
-			socklen_t addr_len = sizeof addr;
-			SOCKET sock = accept(smtp_listen_socket, (sockaddr*)&addr, &addr_len);
-
-			if(sock == INVALID_SOCKET)
-			{
-				m_log.log(LOG_WARN, "Listener::Run(): Error accepting SMTP connection.");
-				continue;
-			}
-
-			// pSD will be freed by the thread routine.
-			StartupData *pSD = new StartupData(sock, m_accounts, m_options);
-
-			if(!create_thread(run_smpt_server, pSD))
-			{
-				m_log.log(LOG_ERROR, "Listener::Run(): Could not create SMTP server thread.");
-				continue;
-			}
-		}
-
-		if(FD_ISSET(pop3_listen_socket, &set))
-		{
-			sockaddr_in addr;
-			socklen_t addr_len = sizeof addr;
-			SOCKET sock = accept(pop3_listen_socket, (sockaddr*)&addr, &addr_len);
-
-			if(sock == INVALID_SOCKET)
-			{
-				m_log.log(LOG_WARN, "Listener::Run(): Error accepting POP3 connection.");
-				continue;
-			}
-
-			// pSD will be freed by the thread routine.
-			StartupData *pSD = new StartupData(sock, m_accounts, m_options);
-
-			if(!create_thread(run_pop3_server, pSD))
-			{
-				m_log.log(LOG_ERROR, "Listener::Run(): Could not create POP3 server thread.");
-				continue;
-			}
-		}
+	m_log.log(LOG_STATUS, "Listener::Run(): Listener shutting down.");
 
-		if(m_options.useHttpMonitor() && FD_ISSET(http_listen_socket, &set))
-		{
-			sockaddr_in addr;
-			socklen_t addr_len = sizeof addr;
-			SOCKET sock = accept(http_listen_socket, (sockaddr*)&addr, &addr_len);
+	// Make sure the other shards are done with their sockets before returning.
+	for(unsigned int i = 1; i < count; ++i)
+		m_shards[i]->Stop();
+	for(unsigned int i = 0; i < started; ++i)
+		wait_semaphore(m_shardExitSemaphore);
 
-			if(sock == INVALID_SOCKET)
-			{
-				m_log.log(LOG_WARN, "Listener::Run(): Error accepting HTTP connection.");
-				continue;
-			}
+	// Commit the messages still waiting. The sessions they belong to are
+	// freed as each is done, which needs the shards.
+	m_committer.stop();
 
-			// pSD will be freed by the thread routine.
-			StartupData *pSD = new StartupData(sock, m_accounts, m_options);
+	// Nothing can queue messages with the Sender now. Stop it here rather than
+	// in the destructor so its threads are done before the caller shuts the
+	// log down.
+	m_pSender->Stop();
+	delete m_pSender;
+	m_pSender = 0;
 
-			if(!create_thread(run_http_server, pSD))
-			{
-				m_log.log(LOG_WARN, "Listener::Run(): Could not create HTTP server thread.");
-				continue;
-			}
-		}
-
-	}
-
-	m_log.log(LOG_STATUS, "Listener::Run(): Listener shutting down.");
-	
-	if(smtp_listen_socket != INVALID_SOCKET)
-		closesocket(smtp_listen_socket);
-	if(pop3_listen_socket != INVALID_SOCKET)
-		closesocket(pop3_listen_socket);
-	if(http_listen_socket != INVALID_SOCKET)
-		closesocket(http_listen_socket);
-
-	return 0;
+	return rc;
 }
 
 void Listener::Stop()
 {
 	m_run = false;
+
+	for(unsigned int i = 0; i < m_shard_count; ++i)
+		m_shards[i]->Stop();
 }
@@ -34,14 +34,129 @@
 #include "options.h"
 #include "accounts.h"
 #include "sender.h"
+#include "reactor.h"
+#include "thread.h"
+#include "worker_pool.h"
+#include "spool_writer.h"
+
+struct SmtpSession;
+struct StartupData;
+
+// A ListenerShard accepts connections on its own listening sockets and runs
+// their sessions on its own worker threads. SMTP sessions are event driven:
+// they only occupy a worker thread while there is input to handle, and wait in
+// the shard's reactor the rest of the time. POP3 and HTTP sessions hold a worker
+// thread from start to finish. When there is more than one shard
+// each of them opens the SMTP and POP3 ports with SO_REUSEPORT, and the kernel
+// spreads incoming connections across them.
+class ListenerShard
+{
+public:
+	// Everything the shard registers with its reactor starts with one of
+	// these, so the event loop can tell what an event's data points to.
+	enum REACTOR_TARGET
+	{
+		RT_LISTEN_SOCKET,
+		RT_SMTP_SESSION
+	};
+
+private:
+	Log m_log;
+	const Options & m_options;
+	Accounts & m_accounts;
+	SpoolCommitter & m_committer;
+	Sender & m_sender;
+	unsigned int m_index; // 0 for the first shard, which also runs the http monitor.
+	unsigned int m_shard_count;
+	Reactor m_reactor;
+	WorkerPool m_sessions; // Runs the SMTP, POP3 and HTTP sessions.
+	volatile bool m_run;
+
+	// The POP3 and HTTP sessions that are queued or running. They block
+	// reading their sockets, so when the shard stops it shuts the sockets
+	// down to end them.
+	StartupData *m_blocking;
+
+	// The SMTP sessions waiting in the reactor, which nothing else would
+	// free when the shard stops.
+	SmtpSession *m_waiting;
+
+	MUTEX m_list_mutex; // Only access m_blocking and m_waiting after acquiring it.
+	bool m_bListMutexCreated;
+
+	// A socket the shard accepts connections on.
+	struct ListenSocket
+	{
+		REACTOR_TARGET target; // Always RT_LISTEN_SOCKET.
+		SOCKET sock;
+		const char* name; // The protocol name, for log messages.
+		THREAD_RETTYPE (WINAPI *session_routine)(void*); // Runs a session for an accepted socket, or NULL for SMTP.
+		const char* busy_reply; // Sent when there is no room to queue a session.
+	};
+
+	// Accept every connection waiting on ls and start a session for each.
+	void acceptConnections(const ListenSocket & ls);
+
+	// Start an event driven SMTP session on sock. Returns false if there is no
+	// room to queue it.
+	bool startSmtpSession(SOCKET sock);
+
+	// Run an SMTP session until it has to wait, then hand its socket back to the reactor.
+	void resumeSmtpSession(SmtpSession *session);
+	static THREAD_RETTYPE WINAPI smtp_session_routine(void* pData);
+
+	// Called by the SpoolCommitter when a session's message is committed.
+	static void smtp_commit_done(void* pData);
+
+	// Free a session the worker pool was stopped before running.
+	static void discard_smtp_session(void* pData);
+	static void discard_blocking_session(void* pData);
+
+	// Run a POP3 or HTTP session. pData is a StartupData.
+	static THREAD_RETTYPE WINAPI pop3_session_routine(void* pData);
+	static THREAD_RETTYPE WINAPI http_session_routine(void* pData);
+
+	// Keep track of the POP3 and HTTP sessions. removeBlockingSession must
+	// be called before the session's socket is closed.
+	void addBlockingSession(StartupData* pSD);
+	void removeBlockingSession(StartupData* pSD);
+
+	// Stop reading from the sockets of all the POP3 and HTTP sessions, so the
+	// sessions end the next time they wait for their clients.
+	void endBlockingSessions();
+
+	// Keep track of the SMTP sessions waiting in the reactor. addWaitingSession
+	// must be called before the session's socket is armed.
+	void addWaitingSession(SmtpSession* session);
+	void removeWaitingSession(SmtpSession* session);
+
+	// Delete the SMTP sessions still waiting in the reactor. Only once no
+	// worker thread is running.
+	void deleteWaitingSessions();
+
+	const ListenerShard & operator=(const ListenerShard &);
+
+public:
+	ListenerShard(const Options & opts, Accounts & accounts, SpoolCommitter & committer,
+		Sender & sender, unsigned int index, unsigned int shard_count);
+	~ListenerShard();
+
+	int Run();
+	void Stop();
+};
 
 class Listener
 {
 	Log m_log;
 	const Options & m_options;
 	Accounts m_accounts;
+	SpoolCommitter m_committer; // Shared by all the shards.
 	Sender *m_pSender;
-	bool m_run;
+	ListenerShard **m_shards;
+	unsigned int m_shard_count;
+	SEMAPHORE m_shardExitSemaphore; // Signaled by each shard thread when it exits.
+	bool m_bShardExitSemCreated;
+	volatile bool m_run;
 
 	const Listener & operator=(const Listener &);
 
@@ -91,10 +91,18 @@ SOURCE=.\accounts.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\arena.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\config_file.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\data_scanner.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\dns_resolve.cpp
 # End Source File
 # Begin Source File
@@ -103,10 +111,18 @@ SOURCE=.\exceptions.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\file_map.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\http_monitor.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\io_ring.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\listener.cpp
 # End Source File
 # Begin Source File
@@ -127,6 +143,10 @@ SOURCE=.\pop3_server.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\reactor.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\sender.cpp
 # End Source File
 # Begin Source File
@@ -143,12 +163,24 @@ SOURCE=.\socket.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\spool_file.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\spool_writer.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\thread.cpp
 # End Source File
 # Begin Source File
 
 SOURCE=.\utility.cpp
 # End Source File
+# Begin Source File
+
+SOURCE=.\worker_pool.cpp
+# End Source File
 # End Group
 # Begin Group "Header Files"
 
@@ -159,10 +191,18 @@ SOURCE=.\accounts.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\arena.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\config_file.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\data_scanner.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\dns_resolve.h
 # End Source File
 # Begin Source File
@@ -171,10 +211,18 @@ SOURCE=.\exceptions.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\file_map.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\http_monitor.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\io_ring.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\listener.h
 # End Source File
 # Begin Source File
@@ -191,6 +239,10 @@ SOURCE=.\pop3_server.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\reactor.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\sender.h
 # End Source File
 # Begin Source File
@@ -207,12 +259,24 @@ SOURCE=.\socket.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\spool_file.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\spool_writer.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\thread.h
 # End Source File
 # Begin Source File
 
 SOURCE=.\utility.h
 # End Source File
+# Begin Source File
+
+SOURCE=.\worker_pool.h
+# End Source File
 # End Group
 # Begin Group "Resource Files"
 
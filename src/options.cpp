@@ -95,6 +95,18 @@ void Options::copy(const Options & opt)
 
 	m_scan_interval = opt.m_scan_interval;
 	m_sender_threads = opt.m_sender_threads;
+	m_domain_threads = opt.m_domain_threads;
+	m_session_threads = opt.m_session_threads;
+	m_session_queue_length = opt.m_session_queue_length;
+	m_listener_shards = opt.m_listener_shards;
+	m_pin_listener_shards = opt.m_pin_listener_shards;
+	m_use_io_uring = opt.m_use_io_uring;
+	m_max_message_size = opt.m_max_message_size;
+	m_mailbox_cache_ttl = opt.m_mailbox_cache_ttl;
+	m_spool_sync = opt.m_spool_sync;
+	m_spool_commit_window = opt.m_spool_commit_window;
+	m_retry_interval = opt.m_retry_interval;
+	m_queue_lifetime = opt.m_queue_lifetime;
 
 	m_use_http_monitor = opt.m_use_http_monitor;
 
@@ -106,6 +118,18 @@ void Options::copy(const Options & opt)
 void Options::set_default_values()
 {
 	m_sender_threads = 5;
+	m_domain_threads = 0;
+	m_session_threads = 50;
+	m_session_queue_length = 200;
+	m_listener_shards = 1;
+	m_pin_listener_shards = false;
+	m_use_io_uring = false;
+	m_max_message_size = 0;
+	m_mailbox_cache_ttl = 30;
+	m_spool_sync = SPOOL_SYNC_NONE;
+	m_spool_commit_window = 1;
+	m_retry_interval = 300;
+	m_queue_lifetime = 5 * 24 * 60 * 60;
 	m_scan_interval = 1;
 	m_smtp_listen_port = 25;
 	m_pop3_listen_port = 110;
@@ -260,6 +284,105 @@ bool Options::loadValuesFromFile(const char* filename)
 			m_sender_threads = tmp;
 	}
 
+	if(cf.getValue("domain_threads", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 0)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid domain_threads value (%d, which is less than 0). Default (%u) used.", tmp, m_domain_threads);
+		else
+			m_domain_threads = tmp;
+	}
+
+	if(cf.getValue("session_threads", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 1)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid session_threads value (%d, which is less than 1). Default (%u) used.", tmp, m_session_threads);
+		else
+			m_session_threads = tmp;
+	}
+
+	if(cf.getValue("session_queue_length", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 1)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid session_queue_length value (%d, which is less than 1). Default (%u) used.", tmp, m_session_queue_length);
+		else
+			m_session_queue_length = tmp;
+	}
+
+	if(cf.getValue("listener_shards", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 1)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid listener_shards value (%d, which is less than 1). Default (%u) used.", tmp, m_listener_shards);
+		else
+			m_listener_shards = tmp;
+	}
+
+	if(cf.getValue("pin_listener_shards", buf, sizeof(buf)))
+		m_pin_listener_shards = atoi(buf) != 0;
+
+	if(cf.getValue("use_io_uring", buf, sizeof(buf)))
+		m_use_io_uring = atoi(buf) != 0;
+
+	if(cf.getValue("max_message_size", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 0)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid max_message_size value (%d, which is less than 0). Default (%lu) used.", tmp, m_max_message_size);
+		else
+			m_max_message_size = tmp;
+	}
+
+	if(cf.getValue("mailbox_cache_ttl", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 0)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid mailbox_cache_ttl value (%d, which is less than 0). Default (%u) used.", tmp, m_mailbox_cache_ttl);
+		else
+			m_mailbox_cache_ttl = tmp;
+	}
+
+	if(cf.getValue("spool_sync", buf, sizeof(buf)))
+	{
+		if(strcasecmp(buf, "none") == 0)
+			m_spool_sync = SPOOL_SYNC_NONE;
+		else if(strcasecmp(buf, "fdatasync") == 0)
+			m_spool_sync = SPOOL_SYNC_DATA;
+		else if(strcasecmp(buf, "fsync") == 0)
+			m_spool_sync = SPOOL_SYNC_FULL;
+		else
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid spool_sync value (%s, which is not none, fdatasync or fsync). Default used.", buf);
+	}
+
+	if(cf.getValue("spool_commit_window", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 0)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid spool_commit_window value (%d, which is less than 0). Default (%u) used.", tmp, m_spool_commit_window);
+		else
+			m_spool_commit_window = tmp;
+	}
+
+	if(cf.getValue("retry_interval", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 1)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid retry_interval value (%d, which is less than 1). Default (%u) used.", tmp, m_retry_interval);
+		else
+			m_retry_interval = tmp;
+	}
+
+	if(cf.getValue("queue_lifetime", buf, sizeof(buf)))
+	{
+		int tmp = atoi(buf);
+		if(tmp < 0)
+			m_log.log(LOG_WARN, "Options::loadValuesFromFile(): Invalid queue_lifetime value (%d, which is less than 0). Default (%u) used.", tmp, m_queue_lifetime);
+		else
+			m_queue_lifetime = tmp;
+	}
+
 	if(cf.getValue("use_http_monitor", buf, sizeof(buf)))
 		m_use_http_monitor = atoi(buf) != 0;
 
@@ -307,6 +430,66 @@ unsigned int Options::senderThreads() const
 	return m_sender_threads;
 }
 
+unsigned int Options::domainThreads() const
+{
+	return m_domain_threads;
+}
+
+unsigned int Options::sessionThreads() const
+{
+	return m_session_threads;
+}
+
+unsigned int Options::sessionQueueLength() const
+{
+	return m_session_queue_length;
+}
+
+unsigned int Options::listenerShards() const
+{
+	return m_listener_shards;
+}
+
+bool Options::pinListenerShards() const
+{
+	return m_pin_listener_shards;
+}
+
+bool Options::useIoUring() const
+{
+	return m_use_io_uring;
+}
+
+unsigned long Options::maxMessageSize() const
+{
+	return m_max_message_size;
+}
+
+unsigned int Options::mailboxCacheTtl() const
+{
+	return m_mailbox_cache_ttl;
+}
+
+SPOOL_SYNC Options::spoolSync() const
+{
+	return m_spool_sync;
+}
+
+unsigned int Options::spoolCommitWindow() const
+{
+	return m_spool_commit_window;
+}
+
+unsigned int Options::retryInterval() const
+{
+	return m_retry_interval;
+}
+
+unsigned int Options::queueLifetime() const
+{
+	return m_queue_lifetime;
+}
+
 bool Options::useHttpMonitor() const
 {
 	return m_use_http_monitor;
@@ -43,6 +43,14 @@ struct DomainList
 	~DomainList();
 };
 
+// How far the SMTP server makes sure a message is on disk before accepting it.
+enum SPOOL_SYNC
+{
+	SPOOL_SYNC_NONE, // Leave it to the operating system.
+	SPOOL_SYNC_DATA, // fdatasync the spool file.
+	SPOOL_SYNC_FULL // fsync the spool file, and the send directory after it is renamed.
+};
+
 class Options
 {
 	Log m_log;
@@ -53,6 +61,18 @@ class Options
 	DomainList *m_domains;
 	unsigned int m_scan_interval;
 	unsigned int m_sender_threads;
+	unsigned int m_domain_threads;
+	unsigned int m_session_threads;
+	unsigned int m_session_queue_length;
+	unsigned int m_listener_shards;
+	bool m_pin_listener_shards;
+	bool m_use_io_uring;
+	unsigned long m_max_message_size;
+	unsigned int m_mailbox_cache_ttl;
+	SPOOL_SYNC m_spool_sync;
+	unsigned int m_spool_commit_window;
+	unsigned int m_retry_interval;
+	unsigned int m_queue_lifetime;
 	bool m_use_http_monitor;
 	char* m_resource_dir;
 
@@ -75,6 +95,18 @@ public:
 	const DomainList * domains() const;
 	unsigned int scanInterval() const;
 	unsigned int senderThreads() const;
+	unsigned int domainThreads() const;
+	unsigned int sessionThreads() const;
+	unsigned int sessionQueueLength() const;
+	unsigned int listenerShards() const;
+	bool pinListenerShards() const;
+	bool useIoUring() const;
+	unsigned long maxMessageSize() const;
+	unsigned int mailboxCacheTtl() const;
+	SPOOL_SYNC spoolSync() const;
+	unsigned int spoolCommitWindow() const;
+	unsigned int retryInterval() const;
+	unsigned int queueLifetime() const;
 	bool useHttpMonitor() const;
 
 	// get and open a resource file for reading in binary mode.
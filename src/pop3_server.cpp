@@ -30,6 +30,7 @@
 #include "pop3_server.h"
 #include "utility.h"
 #include "config_file.h"
+#include "io_ring.h"
 
 #ifndef WIN32
 #include <glob.h>
@@ -154,6 +155,9 @@ bool MessageInfoArray::build_list(const char* mailbox_dir)
 			m_msginfo[m_count].bDelete = false;
 			m_msginfo[m_count].filesize = s.st_size;
 			safe_strcpy(m_msginfo[m_count].filename, buf, sizeof(m_msginfo[m_count].filename));
+
+			m_totalSize += m_msginfo[m_count].filesize;
+			++m_count;
 		}
 	}
 	
@@ -251,7 +255,6 @@ int Pop3Server::run()
 		{
 			char command_buf[POP3_MAX_RESPONSE_LENGTH];
 			char *pcmd_line = command_buf;
-			char command[POP3_MAX_RESPONSE_LENGTH];
 
 			if(!m_sock.getLine(command_buf, sizeof command_buf, NULL))
 			{
@@ -259,7 +262,9 @@ int Pop3Server::run()
 				continue;
 			}
 
-			if(!nexttoken(&pcmd_line, command, sizeof command))
+			unsigned int key = command_key(&pcmd_line);
+
+			if(key == 0)
 			{
 				err("Invalid command");
 				continue;
@@ -268,39 +273,66 @@ int Pop3Server::run()
 			switch(m_state)
 			{
 			case P3S_AUTHORIZATION:
-				if(strcasecmp("USER", command) == 0)
-					user(pcmd_line);
-				else if(m_user.isSet() && strcasecmp("PASS", command) == 0)
-					pass(pcmd_line);
-				else if(strcasecmp("QUIT", command) == 0)
+				switch(key)
 				{
+				case COMMAND_KEY('U', 'S', 'E', 'R'):
+					user(pcmd_line);
+					break;
+
+				case COMMAND_KEY('P', 'A', 'S', 'S'):
+					if(m_user.isSet())
+						pass(pcmd_line);
+					else
+						err("Invalid command");
+					break;
+
+				case COMMAND_KEY('Q', 'U', 'I', 'T'):
 					quit_noupdate();
 					done = true;
-				}
-				else
+					break;
+
+				default:
 					err("Invalid command");
+					break;
+				}
 				break;
 
 			case P3S_TRANSACTION:
-				if(strcasecmp("STAT", command) == 0)
+				switch(key)
+				{
+				case COMMAND_KEY('S', 'T', 'A', 'T'):
 					stat();
-				else if(strcasecmp("LIST", command) == 0)
+					break;
+
+				case COMMAND_KEY('L', 'I', 'S', 'T'):
 					list(pcmd_line);
-				else if(strcasecmp("RETR", command) == 0)
+					break;
+
+				case COMMAND_KEY('R', 'E', 'T', 'R'):
 					retr(pcmd_line);
-				else if(strcasecmp("DELE", command) == 0)
+					break;
+
+				case COMMAND_KEY('D', 'E', 'L', 'E'):
 					dele(pcmd_line);
-				else if(strcasecmp("NOOP", command) == 0)
+					break;
+
+				case COMMAND_KEY('N', 'O', 'O', 'P'):
 					noop();
-				else if(strcasecmp("RSET", command) == 0)
+					break;
+
+				case COMMAND_KEY('R', 'S', 'E', 'T'):
 					rset();
-				else if(strcasecmp("QUIT", command) == 0)
-				{
+					break;
+
+				case COMMAND_KEY('Q', 'U', 'I', 'T'):
 					quit_update();
 					done = true;
-				}
-				else 
+					break;
+
+				default:
 					err("Invalid command");
+					break;
+				}
 				break;
 
 			case P3S_UPDATE:
@@ -467,6 +499,68 @@ void Pop3Server::list(char *command)
 	}
 }
 
+// The size of each read send_file_with_ring makes.
+#define RING_READ_LEN 65536
+
+// Send filesize bytes of fd to sock, reading them through ring. The next read
+// is queued before each block is sent, so the disk and the network are kept
+// busy at the same time. Returns false if nothing could be sent, so the caller
+// can fall back to ordinary reads. Once some data has been sent, errors are
+// thrown as SocketError like any other failed send.
+static bool send_file_with_ring(IoRing *ring, Socket & sock, int fd, long filesize)
+{
+	char *bufs[2];
+	bufs[0] = new char[RING_READ_LEN];
+	bufs[1] = new char[RING_READ_LEN];
+
+	long offset = 0;
+	bool sent = false;
+	bool ok = ring->queueRead(fd, bufs[0], RING_READ_LEN, 0, 0) && ring->submit();
+	bool in_flight = ok; // True while the kernel may still be reading into one of bufs.
+
+	try
+	{
+		while(ok && offset < filesize)
+		{
+			IoCompletion c;
+			in_flight = false;
+			if(!ring->wait(&c) || c.result <= 0)
+			{
+				ok = false;
+				break;
+			}
+
+			char *buf = bufs[c.tag];
+			long next = offset + c.result;
+
+			if(next < filesize)
+				in_flight = ok = ring->queueRead(fd, bufs[1 - c.tag], RING_READ_LEN, next, 1 - c.tag) && ring->submit();
+
+			sock.send(buf, c.result);
+			sent = true;
+			offset = next;
+		}
+	}
+	catch(...)
+	{
+		// Let a read that is still in flight finish before freeing its buffer.
+		IoCompletion c;
+		if(in_flight)
+			ring->wait(&c);
+		delete[] bufs[0];
+		delete[] bufs[1];
+		throw;
+	}
+
+	delete[] bufs[0];
+	delete[] bufs[1];
+
+	if(!ok && sent)
+		throw SocketError("Error reading message file");
+
+	return ok;
+}
+
 void Pop3Server::retr(char *command)
 {
 	int msgnum = atoi(command);
@@ -492,14 +586,28 @@ void Pop3Server::retr(char *command)
 
 	ok(buf);
 
-	// BUFLEN is the size "chunk" we read from files. The bigger it is
-	// the less times we go to disk.
-	const size_t BUFLEN = 30000;
-	char readBuf[BUFLEN];
-	size_t bytesRead;
+	// Mailbox files are stored in wire format, so they can go to the client
+	// straight from the file. If that isn't supported, read them through
+	// io_uring if it's turned on, or else copy them through a buffer.
+	fseek(fp, 0, SEEK_END);
+	long filesize = ftell(fp);
+	rewind(fp);
+
+	IoRing *ring = m_options.useIoUring() ? IoRing::threadRing() : 0;
 
-	while((bytesRead = fread(readBuf, 1, sizeof(readBuf), fp)) > 0)
-		m_sock.send(readBuf, bytesRead);
+	if(filesize < 0 ||
+		(m_sock.sendFile(fileno(fp), 0, filesize) < 0 &&
+		!(ring && send_file_with_ring(ring, m_sock, fileno(fp), filesize))))
+	{
+		// BUFLEN is the size "chunk" we read from files. The bigger it is
+		// the less times we go to disk.
+		const size_t BUFLEN = 30000;
+		char readBuf[BUFLEN];
+		size_t bytesRead;
+
+		while((bytesRead = fread(readBuf, 1, sizeof(readBuf), fp)) > 0)
+			m_sock.send(readBuf, bytesRead);
+	}
 
 	if(ferror(fp))
 		m_log.log(LOG_WARN, "POP3Server::retr(): POP Server: Error reading '%s'", m.filename);
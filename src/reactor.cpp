@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "reactor.h"
+#include "utility.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#endif
+
+#ifdef __linux__
+
+static unsigned int to_epoll_events(unsigned int events)
+{
+	unsigned int e = EPOLLET;
+
+	if(events & REACTOR_READ)
+		e |= EPOLLIN | EPOLLRDHUP;
+	if(events & REACTOR_WRITE)
+		e |= EPOLLOUT;
+	if(events & REACTOR_ONESHOT)
+		e |= EPOLLONESHOT;
+
+	return e;
+}
+
+Reactor::Reactor()
+: m_epoll(-1),
+m_eventfd(-1)
+{
+}
+
+Reactor::~Reactor()
+{
+	if(m_eventfd != -1)
+		::close(m_eventfd);
+	if(m_epoll != -1)
+		::close(m_epoll);
+}
+
+bool Reactor::open()
+{
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if(m_epoll == -1)
+	{
+		m_log.log(LOG_ERROR, "Reactor::open(): Could not create epoll instance.");
+		return false;
+	}
+
+	m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(m_eventfd == -1)
+	{
+		m_log.log(LOG_ERROR, "Reactor::open(): Could not create wakeup eventfd.");
+		return false;
+	}
+
+	// The eventfd is registered with a NULL data pointer, which is how wait
+	// tells it apart from the sockets.
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+
+	if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_eventfd, &ev) != 0)
+	{
+		m_log.log(LOG_ERROR, "Reactor::open(): Could not add wakeup eventfd to epoll.");
+		return false;
+	}
+
+	return true;
+}
+
+bool Reactor::add(SOCKET s, unsigned int events, void* data)
+{
+	struct epoll_event ev;
+	ev.events = to_epoll_events(events);
+	ev.data.ptr = data;
+
+	return epoll_ctl(m_epoll, EPOLL_CTL_ADD, s, &ev) == 0;
+}
+
+bool Reactor::modify(SOCKET s, unsigned int events, void* data)
+{
+	struct epoll_event ev;
+	ev.events = to_epoll_events(events);
+	ev.data.ptr = data;
+
+	return epoll_ctl(m_epoll, EPOLL_CTL_MOD, s, &ev) == 0;
+}
+
+bool Reactor::remove(SOCKET s)
+{
+	// Linux before 2.6.9 insists on a non-NULL event even though it is ignored.
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+
+	return epoll_ctl(m_epoll, EPOLL_CTL_DEL, s, &ev) == 0;
+}
+
+int Reactor::wait(ReactorEvent* events, int maxevents, int timeout_ms)
+{
+	const int MAX_EPOLL_EVENTS = 64;
+	struct epoll_event ev[MAX_EPOLL_EVENTS];
+
+	if(maxevents > MAX_EPOLL_EVENTS)
+		maxevents = MAX_EPOLL_EVENTS;
+
+	int ready = epoll_wait(m_epoll, ev, maxevents, timeout_ms);
+
+	if(ready == -1)
+		return errno == EINTR ? 0 : -1;
+
+	int count = 0;
+	for(int i = 0; i < ready; ++i)
+	{
+		if(ev[i].data.ptr == NULL)
+		{
+			// A wakeup. Reset the eventfd's counter so it can be triggered again.
+			eventfd_t value;
+			eventfd_read(m_eventfd, &value);
+			continue;
+		}
+
+		events[count].data = ev[i].data.ptr;
+		events[count].events = 0;
+
+		if(ev[i].events & EPOLLIN)
+			events[count].events |= REACTOR_READ;
+		if(ev[i].events & EPOLLOUT)
+			events[count].events |= REACTOR_WRITE;
+		if(ev[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			events[count].events |= REACTOR_HANGUP;
+
+		++count;
+	}
+
+	return count;
+}
+
+void Reactor::wakeup()
+{
+	// write is safe to call from a signal handler, which is where Listener::Stop
+	// is usually called from.
+	eventfd_t value = 1;
+	if(::write(m_eventfd, &value, sizeof value) != sizeof value)
+	{
+		// The counter is already non-zero, so the wait will wake up anyway.
+	}
+}
+
+#else
+
+// Without epoll, fall back to select. Since select can't be interrupted from
+// another thread portably, never block in it for more than this many
+// milliseconds so that wakeup is noticed reasonably quickly.
+#define REACTOR_MAX_SELECT_WAIT 1000
+
+Reactor::Reactor()
+: m_entries(0),
+m_entry_count(0),
+m_entry_max(0),
+m_wakeup_pending(false)
+{
+	create_mutex(m_entry_mutex);
+}
+
+Reactor::~Reactor()
+{
+	delete[] m_entries;
+	delete_mutex(m_entry_mutex);
+}
+
+bool Reactor::open()
+{
+	return true;
+}
+
+Reactor::Entry* Reactor::find(SOCKET s)
+{
+	for(int i = 0; i < m_entry_count; ++i)
+	{
+		if(m_entries[i].sock == s)
+			return &m_entries[i];
+	}
+
+	return NULL;
+}
+
+bool Reactor::add(SOCKET s, unsigned int events, void* data)
+{
+	wait_mutex(m_entry_mutex);
+
+	if(m_entry_count >= FD_SETSIZE || find(s))
+	{
+		release_mutex(m_entry_mutex);
+		return false;
+	}
+
+	if(m_entry_count >= m_entry_max)
+	{
+		m_entry_max += 16;
+		Entry *p = new Entry[m_entry_max];
+		memcpy(p, m_entries, m_entry_count * sizeof(Entry));
+		delete[] m_entries;
+		m_entries = p;
+	}
+
+	m_entries[m_entry_count].sock = s;
+	m_entries[m_entry_count].events = events;
+	m_entries[m_entry_count].data = data;
+	m_entries[m_entry_count].armed = true;
+	++m_entry_count;
+
+	release_mutex(m_entry_mutex);
+	return true;
+}
+
+bool Reactor::modify(SOCKET s, unsigned int events, void* data)
+{
+	wait_mutex(m_entry_mutex);
+
+	Entry *e = find(s);
+	if(e)
+	{
+		e->events = events;
+		e->data = data;
+		e->armed = true;
+	}
+
+	release_mutex(m_entry_mutex);
+	return e != NULL;
+}
+
+bool Reactor::remove(SOCKET s)
+{
+	wait_mutex(m_entry_mutex);
+
+	Entry *e = find(s);
+	if(e)
+		*e = m_entries[--m_entry_count];
+
+	release_mutex(m_entry_mutex);
+	return e != NULL;
+}
+
+int Reactor::wait(ReactorEvent* events, int maxevents, int timeout_ms)
+{
+	fd_set readset, writeset;
+	SOCKET maxsock = 0;
+
+	if(m_wakeup_pending)
+	{
+		m_wakeup_pending = false;
+		return 0;
+	}
+
+	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
+
+	wait_mutex(m_entry_mutex);
+	for(int i = 0; i < m_entry_count; ++i)
+	{
+		const Entry & e = m_entries[i];
+		if(!e.armed)
+			continue;
+		if(e.events & REACTOR_READ)
+			FD_SET(e.sock, &readset);
+		if(e.events & REACTOR_WRITE)
+			FD_SET(e.sock, &writeset);
+		if(e.sock > maxsock)
+			maxsock = e.sock;
+	}
+	release_mutex(m_entry_mutex);
+
+	if(timeout_ms < 0 || timeout_ms > REACTOR_MAX_SELECT_WAIT)
+		timeout_ms = REACTOR_MAX_SELECT_WAIT;
+
+	struct timeval tv;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	int ready = select(maxsock + 1, &readset, &writeset, NULL, &tv);
+
+	if(ready == 0 || m_wakeup_pending)
+	{
+		m_wakeup_pending = false;
+		return 0;
+	}
+
+	if(ready < 0)
+		return 0; // Most likely interrupted by a signal.
+
+	int count = 0;
+
+	wait_mutex(m_entry_mutex);
+	for(int i = 0; i < m_entry_count && count < maxevents; ++i)
+	{
+		Entry & e = m_entries[i];
+		if(!e.armed)
+			continue;
+
+		unsigned int ev = 0;
+		if(FD_ISSET(e.sock, &readset))
+			ev |= REACTOR_READ;
+		if(FD_ISSET(e.sock, &writeset))
+			ev |= REACTOR_WRITE;
+
+		if(ev)
+		{
+			events[count].data = e.data;
+			events[count].events = ev;
+			++count;
+
+			if(e.events & REACTOR_ONESHOT)
+				e.armed = false;
+		}
+	}
+	release_mutex(m_entry_mutex);
+
+	return count;
+}
+
+void Reactor::wakeup()
+{
+	m_wakeup_pending = true;
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// reactor.h - wait for activity on many sockets at once. On Linux this uses
+// epoll with edge-triggered notification. Elsewhere it falls back to select.
+
+#ifndef MAILSERV_REACTOR_H
+#define MAILSERV_REACTOR_H
+
+#include "socket.h"
+#include "log.h"
+#include "thread.h"
+
+// Event flags. REACTOR_READ and REACTOR_WRITE are passed to add and modify to
+// say what to wait for. wait reports them, plus REACTOR_HANGUP if the other side
+// closed the connection or an error occurred on the socket.
+#define REACTOR_READ 0x01
+#define REACTOR_WRITE 0x02
+#define REACTOR_HANGUP 0x04
+
+// Pass REACTOR_ONESHOT along with the other flags to have the socket disabled
+// after it is reported once. Call modify to wait for it again. This lets one
+// thread hand a socket off to another without the socket being reported again
+// while the other thread is still working on it.
+#define REACTOR_ONESHOT 0x08
+
+struct ReactorEvent
+{
+	void *data; // The data pointer given to add or modify.
+	unsigned int events; // REACTOR_READ, REACTOR_WRITE and/or REACTOR_HANGUP.
+};
+
+class Reactor
+{
+	Log m_log;
+
+#ifdef __linux__
+	int m_epoll; // The epoll instance.
+	int m_eventfd; // Written to by wakeup to interrupt wait.
+#else
+	// select doesn't keep any state between calls, so the registered sockets
+	// are kept here.
+	struct Entry
+	{
+		SOCKET sock;
+		unsigned int events;
+		void *data;
+		bool armed; // False when a REACTOR_ONESHOT socket has been reported.
+	} *m_entries;
+	int m_entry_count;
+	int m_entry_max;
+	MUTEX m_entry_mutex;
+	volatile bool m_wakeup_pending;
+
+	Entry* find(SOCKET s);
+#endif
+
+	// The assignment operator is made private so that no one uses it. It has no definition.
+	Reactor(const Reactor &);
+	const Reactor & operator=(const Reactor &);
+
+public:
+	Reactor();
+	~Reactor();
+
+	// Create the underlying epoll instance. Returns false if it can't be created.
+	bool open();
+
+	// Readiness is reported edge-triggered: once a socket has been reported as
+	// readable (or writable) it won't be reported again until more data arrives
+	// (or more room is made), so read (or write) until the call would block.
+	// Sockets should be put into non-blocking mode with set_nonblocking first.
+	bool add(SOCKET s, unsigned int events, void* data);
+	bool modify(SOCKET s, unsigned int events, void* data);
+	bool remove(SOCKET s);
+
+	// Wait up to timeout_ms milliseconds (forever if it is -1) for events and
+	// store up to maxevents of them in events. Returns the number of events
+	// stored, which is 0 if the wait timed out, was interrupted by a signal or
+	// was ended by wakeup. Returns -1 on error.
+	int wait(ReactorEvent* events, int maxevents, int timeout_ms);
+
+	// Make a wait in progress (or the next one) return right away. This may be
+	// called from any thread and from a signal handler.
+	void wakeup();
+};
+
+#endif
@@ -30,19 +30,41 @@
 #include "utility.h"
 #include "sender.h"
 #include "dns_resolve.h"
+#include "spool_file.h"
+#include "file_map.h"
+#include "spool_writer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifndef WIN32
 #include <glob.h>
-#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#define SENDER_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
 #endif
 
 Sender::Mailbox::Mailbox(Mailbox *newNext, const char* newUser, const char* newDomain)
 : next(newNext),
 nextRemote(0),
-failed(false)
+failed(false),
+retry(false),
+reason(RF_UNKNOWN)
 {
 	user = strdupnew(newUser);
 	domain = strdupnew(newDomain);
@@ -57,9 +79,20 @@ Sender::Mailbox::~Mailbox()
 
 
 Sender::FileList::FileList(Sender::FileList *newNext, const char* newFilename)
-: next(newNext)
+: next(newNext),
+hashNext(0),
+domain(0)
 {
 	filename = strdupnew(newFilename);
+
+	// The same file may be named with different paths to the directory.
+	name = strrchr(filename, DIR_DELIM);
+	name = name ? name + 1 : filename;
+
+	// FNV-1a.
+	hash = 2166136261u;
+	for(const char *p = name; *p; ++p)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
 }
 
 Sender::FileList::~FileList()
@@ -68,65 +101,293 @@ Sender::FileList::~FileList()
 	delete next;
 }
 
+Sender::DomainQueue::DomainQueue(const char* newName, unsigned int newHash)
+: hashNext(0),
+readyNext(0),
+hash(newHash),
+head(0),
+tail(0),
+sending(0),
+ready(false)
+{
+	name = strdupnew(newName);
+}
+
+Sender::DomainQueue::~DomainQueue()
+{
+	delete[] name;
+	delete head;
+}
+
 Sender::Sender(const Options & options, const Accounts & accounts)
 : m_options(options),
 m_accounts(accounts),
+m_run(false),
+m_thread_count(0),
+m_exit_count(0),
+m_bExitSemCreated(false),
 m_bFileListSemCreated(false),
 m_bFileListMutexCreated(false),
-m_bFileListEmptySemCreated(false),
-m_pfiles(0)
+m_ready_head(0),
+m_ready_tail(0),
+m_watch_fd(-1),
+m_retries(0),
+m_retry_count(0),
+m_retry_size(0),
+m_bRetryMutexCreated(false)
 {
+	for(unsigned int i = 0; i < SENDER_FILE_BUCKETS; ++i)
+		m_known[i] = 0;
+	for(unsigned int i = 0; i < SENDER_DOMAIN_BUCKETS; ++i)
+		m_domains[i] = 0;
 }
 
 Sender::~Sender()
 {
-	delete_semaphore(m_fileListSemaphore);
-	delete_mutex(m_fileListMutex);
-	delete_semaphore(m_fileListEmptySemaphore);
+	if(m_bFileListSemCreated)
+		delete_semaphore(m_fileListSemaphore);
+	if(m_bFileListMutexCreated)
+		delete_mutex(m_fileListMutex);
+	if(m_bExitSemCreated)
+		delete_semaphore(m_exitSemaphore);
+	if(m_bRetryMutexCreated)
+		delete_mutex(m_retryMutex);
+
+	// The threads have stopped, so these only hold files that weren't sent.
+	for(unsigned int i = 0; i < SENDER_DOMAIN_BUCKETS; ++i)
+	{
+		while(m_domains[i])
+		{
+			DomainQueue *d = m_domains[i];
+			m_domains[i] = d->hashNext;
+			delete d;
+		}
+	}
+
+	for(unsigned int i = 0; i < m_retry_count; ++i)
+		delete[] m_retries[i].filename;
+	delete[] m_retries;
 
-	delete m_pfiles;
+#ifdef SENDER_INOTIFY
+	if(m_watch_fd != -1)
+		close(m_watch_fd);
+#endif
 }
 
-THREAD_RETTYPE WINAPI Sender::thread_routine(void* pData)
+bool Sender::enqueue(const char* filename, const char* domain)
 {
-	Sender *pThis = (Sender*)pData;
+	FileList *p = new FileList(NULL, filename);
 
-	while(pThis->m_run)
+	if(!wait_mutex(m_fileListMutex))
 	{
-		if(wait_semaphore(pThis->m_fileListSemaphore))
+		m_log.log(LOG_WARN, "Sender::enqueue(): Error while waiting for file list mutex. '%s' will be sent after a restart.", filename);
+		delete p;
+		return false;
+	}
+
+	FileList **chain = &m_known[p->hash % SENDER_FILE_BUCKETS];
+
+	for(FileList *k = *chain; k; k = k->hashNext)
+	{
+		if(strcmp(k->name, p->name) == 0)
 		{
-			if(wait_mutex(pThis->m_fileListMutex))
-			{
-				if(pThis->m_pfiles)
-				{
-					FileList *p = pThis->m_pfiles;
-					pThis->m_pfiles = pThis->m_pfiles->next;
+			release_mutex(m_fileListMutex);
+			delete p;
+			return false;
+		}
+	}
 
-					p->next = 0; // Remove this node from the list so that we can delete it
-								// without deleting all the nodes.
+	p->hashNext = *chain;
+	*chain = p;
 
-					release_mutex(pThis->m_fileListMutex);
+	release_mutex(m_fileListMutex);
 
-					pThis->process_file(p->filename);
+	// Files whose domain can't be read are queued together under "".
+	char buf[SENDER_MAX_DOMAIN];
+	if(!domain)
+		domain = read_domain(filename, buf, sizeof buf) ? buf : "";
 
-					// If this is the last file then signal the thread that
-					// builds the file list. You must signal after you process the file,
-					// otherwise the file may be processed again when the file list builder
-					// re-adds it to the list of files to process. This will cause the other
-					// threads to sit around until this one finishes.
-					if(pThis->m_pfiles == 0)
-						signal_semaphore(pThis->m_fileListEmptySemaphore);
-					delete p;
-				}
-				else
+	if(!wait_mutex(m_fileListMutex))
+	{
+		m_log.log(LOG_WARN, "Sender::enqueue(): Error while waiting for file list mutex. '%s' will be sent after a restart.", filename);
+		finished(p);
+		return false;
+	}
+
+	DomainQueue *d = find_domain(domain);
+	p->domain = d;
+
+	if(d->tail)
+		d->tail->next = p;
+	else
+		d->head = p;
+	d->tail = p;
+
+	make_ready(d);
+
+	release_mutex(m_fileListMutex);
+
+	signal_semaphore(m_fileListSemaphore);
+	return true;
+}
+
+Sender::DomainQueue* Sender::find_domain(const char* domain)
+{
+	// Domain names aren't case sensitive.
+	char name[SENDER_MAX_DOMAIN];
+	if(strlen(domain) >= sizeof name)
+		domain = "";
+
+	unsigned int hash = 2166136261u; // FNV-1a.
+	unsigned int i;
+	for(i = 0; domain[i]; ++i)
+	{
+		name[i] = (char)tolower((unsigned char)domain[i]);
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	name[i] = 0;
+
+	DomainQueue **chain = &m_domains[hash % SENDER_DOMAIN_BUCKETS];
+
+	for(DomainQueue *d = *chain; d; d = d->hashNext)
+	{
+		if(d->hash == hash && strcmp(d->name, name) == 0)
+			return d;
+	}
+
+	DomainQueue *d = new DomainQueue(name, hash);
+	d->hashNext = *chain;
+	*chain = d;
+	return d;
+}
+
+void Sender::make_ready(DomainQueue* d)
+{
+	unsigned int limit = m_options.domainThreads();
+
+	if(d->ready || !d->head || (limit != 0 && d->sending >= limit))
+		return;
+
+	if(m_ready_tail)
+		m_ready_tail->readyNext = d;
+	else
+		m_ready_head = d;
+	m_ready_tail = d;
+	d->ready = true;
+}
+
+Sender::FileList* Sender::take()
+{
+	if(!wait_mutex(m_fileListMutex))
+		return 0;
+
+	FileList *p = 0;
+	DomainQueue *d = m_ready_head;
+
+	if(d)
+	{
+		m_ready_head = d->readyNext;
+		if(!m_ready_head)
+			m_ready_tail = 0;
+		d->readyNext = 0;
+		d->ready = false;
+
+		// A domain is only ready while it has files queued.
+		p = d->head;
+		d->head = p->next;
+		if(!d->head)
+			d->tail = 0;
+		p->next = 0;
+
+		++d->sending;
+
+		// Let the other ready domains go first next time.
+		make_ready(d);
+	}
+
+	release_mutex(m_fileListMutex);
+	return p;
+}
+
+void Sender::finished(FileList *p)
+{
+	bool more = false;
+
+	if(!wait_mutex(m_fileListMutex))
+	{
+		// p can't be taken out of m_known, so it has to be left there.
+		m_log.log(LOG_WARN, "Sender::finished(): Error while waiting for file list mutex.");
+		return;
+	}
+
+	for(FileList **pp = &m_known[p->hash % SENDER_FILE_BUCKETS]; *pp; pp = &(*pp)->hashNext)
+	{
+		if(*pp == p)
+		{
+			*pp = p->hashNext;
+			break;
+		}
+	}
+
+	DomainQueue *d = p->domain;
+	if(d)
+	{
+		--d->sending;
+
+		if(d->head)
+		{
+			// domain_threads may have kept the files behind this one waiting.
+			make_ready(d);
+			more = true;
+		}
+		else if(d->sending == 0)
+		{
+			// Nothing is left for the domain, so forget it.
+			for(DomainQueue **pd = &m_domains[d->hash % SENDER_DOMAIN_BUCKETS]; *pd; pd = &(*pd)->hashNext)
+			{
+				if(*pd == d)
 				{
-					pThis->m_log.log(LOG_WARN, "Sender::thread_routine(): Error: m_pfiles is an empty list but the semaphore indicates it shouldn't be.");
-					release_mutex(pThis->m_fileListMutex);
+					*pd = d->hashNext;
+					break;
 				}
 			}
+			delete d;
 		}
 	}
-	
+
+	release_mutex(m_fileListMutex);
+
+	p->next = 0; // Remove this node from the list so that we can delete it
+				// without deleting all the nodes.
+	delete p;
+
+	// Wake a thread in case all of them went back to waiting while the
+	// domain was at its limit.
+	if(more)
+		signal_semaphore(m_fileListSemaphore);
+}
+
+THREAD_RETTYPE WINAPI Sender::thread_routine(void* pData)
+{
+	Sender *pThis = (Sender*)pData;
+
+	while(wait_semaphore(pThis->m_fileListSemaphore) && pThis->m_run)
+	{
+		// The semaphore is signaled for each file queued, but the file may
+		// have been taken by another thread or be held back by
+		// domain_threads. Then there is nothing to do until it is signaled
+		// again.
+		FileList *p = pThis->take();
+		if(!p)
+			continue;
+
+		// Each file is only ever queued once, so no other thread can be
+		// sending it.
+		pThis->process_file(p->filename);
+		pThis->finished(p);
+	}
+
+	signal_semaphore(pThis->m_exitSemaphore);
 	return 0;
 }
 
@@ -154,35 +415,193 @@ static bool getLine(FILE *fp, char *buf, const size_t MAXBUFLEN)
 	return false;
 }
 
-void Sender::process_file(const char* filename)
+// Read len bytes at offset from fp without moving its file position.
+// Returns the number of bytes read, which is less than len at the end of the
+// file, or -1 on error.
+static long read_at(FILE* fp, void* buf, unsigned long len, long offset)
 {
-	Mailbox *from = 0;
-	Mailbox *to = 0;
-	Mailbox *p = 0;
-	Mailbox *remote = 0;
-	bool incomplete = false;
+#ifdef WIN32
+	if(fseek(fp, offset, SEEK_SET) != 0)
+		return -1;
 
-	FILE *fp = fopen(filename, "rb");
-	char line[SMTP_MAX_TEXT_LINE];
-	long pos, endpos;
+	size_t n = fread(buf, 1, len, fp);
+	return ferror(fp) ? -1 : (long)n;
+#else
+	return (long)pread(fileno(fp), buf, len, offset);
+#endif
+}
 
+bool Sender::read_domain(const char* filename, char* domain, unsigned int size) const
+{
+	FILE *fp = fopen(filename, "rb");
 	if(!fp)
+		return false;
+
+	// The first recipient is well within the first block.
+	unsigned char buf[4096];
+	long len = read_at(fp, buf, sizeof buf, 0);
+	fclose(fp);
+
+	SpoolHeader header;
+	if(len < SPOOL_HEADER_SIZE || !spool_header_decode(buf, header))
+		return false;
+
+	const unsigned char *p = buf + SPOOL_HEADER_SIZE;
+	const unsigned char *end = buf + len;
+	if(header.envelopeLength < (unsigned long)(end - p))
+		end = p + header.envelopeLength;
+
+	if(header.flags & SPOOL_FLAG_RETRY)
 	{
-		m_log.log(LOG_WARN, "Sender::process_file(): Error opening '%s'", filename);
-		goto error;
+		if(end - p < SPOOL_RETRY_SIZE)
+			return false;
+		p += SPOOL_RETRY_SIZE;
+	}
+
+	// Skip the from mailbox and the recipient's local part.
+	char skip[SMTP_MAX_TEXT_LINE];
+	return spool_string_decode(&p, end, skip, sizeof skip) &&
+		spool_string_decode(&p, end, skip, sizeof skip) &&
+		spool_string_decode(&p, end, skip, sizeof skip) &&
+		spool_string_decode(&p, end, domain, size);
+}
+
+bool Sender::readEnvelope(FILE* fp, const char* filename, Mailbox*& from, Mailbox*& to,
+						  long & body, long & endpos, SpoolRetry & retry, bool & incomplete) const
+{
+	// Unless the file says otherwise, this is the first attempt to send it.
+	retry.attempts = 0;
+	retry.first = time(NULL);
+	retry.next = 0;
+
+	// Most envelopes fit in here along with the header, so one read gets both.
+	unsigned char buf[4096];
+	long len = read_at(fp, buf, sizeof buf, 0);
+
+	if(len < 0)
+	{
+		m_log.log(LOG_WARN, "Sender::readEnvelope(): Error reading '%s'", filename);
+		return false;
+	}
+
+	if(len >= SPOOL_MAGIC_SIZE && memcmp(buf, SPOOL_MAGIC, SPOOL_MAGIC_SIZE) != 0)
+		return readTextEnvelope(fp, filename, from, to, body, endpos, incomplete);
+
+	SpoolHeader header;
+	if(len < SPOOL_HEADER_SIZE || !spool_header_decode(buf, header))
+	{
+		m_log.log(LOG_SERVER, "Sender::readEnvelope(): Error: '%s' is not a sender file", filename);
+		return false;
+	}
+
+	if(header.version != SPOOL_VERSION || (header.flags & ~SPOOL_FLAGS_KNOWN) != 0)
+	{
+		m_log.log(LOG_SERVER, "Sender::readEnvelope(): Error: '%s' is from a newer version (version %u, flags %u)",
+			filename, header.version, header.flags);
+		return false;
+	}
+
+	if(header.bodyOffset != SPOOL_HEADER_SIZE + header.envelopeLength || header.recipientCount == 0 ||
+		header.bodyLength > LONG_MAX - header.bodyOffset)
+	{
+		m_log.log(LOG_SERVER, "Sender::readEnvelope(): Error: Bad header in sender file '%s'", filename);
+		return false;
+	}
+
+	// The header is only filled in once the file is complete, so a file that is
+	// shorter than it says may still be being written to.
+	struct stat st;
+	if(fstat(fileno(fp), &st) != 0)
+	{
+		m_log.log(LOG_WARN, "Sender::readEnvelope(): Error getting the size of '%s'", filename);
+		return false;
+	}
+
+	if((unsigned long)st.st_size != header.bodyOffset + header.bodyLength)
+	{
+		m_log.log(LOG_SERVER, "Sender::readEnvelope(): Error: Sender file '%s' is %lu bytes but should be %lu",
+			filename, (unsigned long)st.st_size, header.bodyOffset + header.bodyLength);
+		incomplete = (unsigned long)st.st_size < header.bodyOffset + header.bodyLength;
+		return false;
+	}
+
+	unsigned char *envelope = buf + SPOOL_HEADER_SIZE;
+	unsigned char *allocated = 0;
+
+	if(header.bodyOffset > (unsigned long)len)
+	{
+		envelope = allocated = new unsigned char[header.envelopeLength];
+		if(read_at(fp, envelope, header.envelopeLength, SPOOL_HEADER_SIZE) != (long)header.envelopeLength)
+		{
+			m_log.log(LOG_WARN, "Sender::readEnvelope(): Error reading the envelope of '%s'", filename);
+			delete[] allocated;
+			return false;
+		}
+	}
+
+	const unsigned char *p = envelope;
+	const unsigned char *end = envelope + header.envelopeLength;
+	bool rc = true;
+
+	if(header.flags & SPOOL_FLAG_RETRY)
+	{
+		rc = end - p >= SPOOL_RETRY_SIZE;
+		if(rc)
+		{
+			spool_retry_decode(p, retry);
+			p += SPOOL_RETRY_SIZE;
+		}
+	}
+
+	// The first mailbox is the from mailbox. After the from are the to mailboxes.
+	for(unsigned int i = 0; i <= header.recipientCount && rc; ++i)
+	{
+		char user[SMTP_MAX_TEXT_LINE];
+		char domain[SMTP_MAX_TEXT_LINE];
+
+		rc = spool_string_decode(&p, end, user, sizeof user) &&
+			spool_string_decode(&p, end, domain, sizeof domain);
+
+		if(!rc)
+			break;
+
+		if(!from)
+			from = new Mailbox(NULL, user, domain);
+		else
+			to = new Mailbox(to, user, domain);
+	}
+
+	delete[] allocated;
+
+	if(!rc || p != end)
+	{
+		m_log.log(LOG_SERVER, "Sender::readEnvelope(): Error: Bad envelope in sender file '%s'", filename);
+		return false;
 	}
 
+	// The local mailboxes get the text without the terminating <CRLF>.<CRLF>.
+	body = (long)header.bodyOffset;
+	endpos = header.bodyLength > 5 ? body + (long)header.bodyLength - 5 : body;
+	return true;
+}
+
+bool Sender::readTextEnvelope(FILE* fp, const char* filename, Mailbox*& from, Mailbox*& to,
+							  long & body, long & endpos, bool & incomplete) const
+{
+	char line[SMTP_MAX_TEXT_LINE];
+	long pos;
+
 	// Make sure this is a sender file.
-	if(!getLine(fp, line, sizeof line))
+	if(fseek(fp, 0, SEEK_SET) != 0 || !getLine(fp, line, sizeof line))
 	{
-		m_log.log(LOG_WARN, "Sender::process_file(): Error reading sender file header string from '%s'", filename);
-			goto error;
+		m_log.log(LOG_WARN, "Sender::readTextEnvelope(): Error reading sender file header string from '%s'", filename);
+		return false;
 	}
 
 	if(strcmp(line, "MAILSERV SENDER FILE") != 0)
 	{
-		m_log.log(LOG_SERVER, "Sender::process_file(): Error: First line of '%s' was not MAILSERV SENDER FILE", filename);
-		goto error;
+		m_log.log(LOG_SERVER, "Sender::readTextEnvelope(): Error: First line of '%s' was not MAILSERV SENDER FILE", filename);
+		return false;
 	}
 
 	pos = ftell(fp); // Save the current position.
@@ -190,30 +609,30 @@ void Sender::process_file(const char* filename)
 	// Make sure the file ends with <CRLF>.<CRLF>. Otherwise it may not have been completly written.
 	if(fseek(fp, -5, SEEK_END) != 0)
 	{
-		m_log.log(LOG_SERVER, "Sender::process_file(): Error seeking to end of '%s'.", filename);
-		goto error;
+		m_log.log(LOG_SERVER, "Sender::readTextEnvelope(): Error seeking to end of '%s'.", filename);
+		return false;
 	}
 
 	endpos = ftell(fp);
 
 	if(fread(line, 1, 5, fp) != 5)
 	{
-		m_log.log(LOG_SERVER, "Sender::process_file(): Error: Sender file '%s' does not end in <CRLF>.<CRLF>", filename);
+		m_log.log(LOG_SERVER, "Sender::readTextEnvelope(): Error: Sender file '%s' does not end in <CRLF>.<CRLF>", filename);
 		incomplete = true;
-		goto error;
+		return false;
 	}
 
 	if(!(line[0] == CR && line[1] == LF && line[2] == '.' && line[3] == CR && line[4] == LF))
 	{
-		m_log.log(LOG_SERVER, "Sender::process_file(): Error: Sender file '%s' does not end in <CRLF>.<CRLF>", filename);
-		goto error;
+		m_log.log(LOG_SERVER, "Sender::readTextEnvelope(): Error: Sender file '%s' does not end in <CRLF>.<CRLF>", filename);
+		return false;
 	}
 
 	if(fseek(fp, pos, SEEK_SET))
 	{
 		// Move to the saved position (right after MAILSERV SENDER FILE).
-		m_log.log(LOG_SERVER, "Sender::process_file(): Error seeking to position after MAILSERV SEDNER FILE in '%s'", filename);
-		goto error;
+		m_log.log(LOG_SERVER, "Sender::readTextEnvelope(): Error seeking to position after MAILSERV SEDNER FILE in '%s'", filename);
+		return false;
 	}
 
 	// Get the from and to mailboxes.
@@ -222,14 +641,14 @@ void Sender::process_file(const char* filename)
 		char domain[SMTP_MAX_TEXT_LINE];
 		if(!getLine(fp, domain, sizeof domain))
 		{
-			m_log.log(LOG_SERVER, "Sender::process_file(): Error getting the domain for '%s'", line);
-			goto error;
+			m_log.log(LOG_SERVER, "Sender::readTextEnvelope(): Error getting the domain for '%s'", line);
+			return false;
 		}
 
 		if(strcmp(domain, "<END>") == 0)
 		{
-			m_log.log(LOG_SERVER, "Sender::process_file(): Expecting domain for user '%s' but got <END>", line);
-			goto error;
+			m_log.log(LOG_SERVER, "Sender::readTextEnvelope(): Expecting domain for user '%s' but got <END>", line);
+			return false;
 		}
 
 		// The first mailbox is the from mailbox. After the from are the to mailboxes.
@@ -239,6 +658,41 @@ void Sender::process_file(const char* filename)
 			to = new Mailbox(to, line, domain);
 	}
 
+	body = ftell(fp); // The message data starts here.
+	return true;
+}
+
+void Sender::process_file(const char* filename)
+{
+	Mailbox *from = 0;
+	Mailbox *to = 0;
+	Mailbox *p = 0;
+	Mailbox *remote = 0;
+	Mailbox *last_remote = 0;
+	bool incomplete = false;
+	FileMap body;
+	size_t text_len;
+	char *delivered = 0; // A local mailbox's copy of the message that the others can link to.
+	SpoolRetry retry;
+	bool can_retry;
+	bool deferred = false;
+
+	FILE *fp = fopen(filename, "rb");
+	long pos, endpos;
+
+	// The watch can report a file again just after it has been sent.
+	if(!fp && errno == ENOENT)
+		return;
+
+	if(!fp)
+	{
+		m_log.log(LOG_WARN, "Sender::process_file(): Error opening '%s'", filename);
+		goto error;
+	}
+
+	if(!readEnvelope(fp, filename, from, to, pos, endpos, retry, incomplete))
+		goto error;
+
 	if(!from)
 	{
 		m_log.log(LOG_SERVER, "Sender::process_file(): Error: No from in sender file '%s'", filename);
@@ -251,7 +705,19 @@ void Sender::process_file(const char* filename)
 		goto error;
 	}
 
-	pos = ftell(fp); // Save the current position because it is where the message data starts.
+	// Read the message once for all of the recipients.
+	if(!body.open(fp, pos))
+	{
+		m_log.log(LOG_WARN, "Sender::process_file(): Error reading the message in '%s'", filename);
+		goto error;
+	}
+
+	fclose(fp);
+	fp = 0;
+
+	text_len = endpos > pos ? (size_t)(endpos - pos) : 0;
+	if(text_len > body.size())
+		text_len = body.size();
 
 	// Put the message data in local mailboxes first, since this is a fast operation.
 	for(p = to; p; p = p->next)
@@ -263,48 +729,78 @@ void Sender::process_file(const char* filename)
 			p->failed = true; // If it is local but not found then mark it as an error.
 			break;
 		case MS_DOMAIN_NOT_LOCAL:
-			if(remote)
-				remote = remote->nextRemote = p;
+			if(last_remote)
+				last_remote = last_remote->nextRemote = p;
 			else
-				remote = p;
+				remote = last_remote = p;
 			break;
 		case MS_OK:
-			if(!copyMessageToLocalMailbox(fp, endpos, mailbox_dir))
-				p->failed = true;
-			
-			fseek(fp, pos, SEEK_SET);
+			{
+				char *copy = 0;
+				if(!copyMessageToLocalMailbox(body.data(), text_len, mailbox_dir, delivered, &copy))
+				{
+					// The mailbox may have been removed since it was looked up.
+					m_accounts.invalidateMailbox(p->domain, p->user);
+					p->failed = true;
+				}
+				else if(copy)
+				{
+					// The message couldn't be linked to delivered, perhaps because
+					// this mailbox is on another file system, so the mailboxes
+					// after it link to this copy.
+					delete[] delivered;
+					delivered = copy;
+				}
+			}
 			break;
 		}
 
 		delete[] mailbox_dir;
 	}
 
+	// A message that can't be sent yet is kept for as long as queue_lifetime allows.
+	can_retry = time(NULL) < retry.first + (time_t)m_options.queueLifetime();
+
 	// Send the message data to remote mailboxes.
-	for(p = remote; p; p = p->next)
+	for(p = remote; p; p = p->nextRemote)
 	{
-		REASON_FAILED reason = RF_UNKNOWN;
+		bool temporary = false;
 
-		if(!sendMessageToRemoteMailbox(fp, from, p, reason))
-		{
+		if(sendMessageToRemoteMailbox(body.data(), body.size(), from, p, p->reason, temporary))
+			continue;
+
+		if(temporary && can_retry)
+			deferred = p->retry = true;
+		else
 			p->failed = true;
-			// If we couldn't send the message then bounce the message back to
-			// the sender. If we can't do this then log the fact and don't do anything
-			// else, because we do not want to get into a loop where we keep bouncing
-			// the message.
-			fseek(fp, pos, SEEK_SET);
-			if(!sendBounceMessage(fp, from, p, reason))
-			{
-				m_log.log(LOG_STATUS, "Sender::process_file(): Error sending bounce message to %s@%s (couldn't send to %s@%s)",
-					from->user, from->domain, p->user, p->domain);
-			}
-		}
+	}
 
-		fseek(fp, pos, SEEK_SET);
+	// Keep the message for the recipients it may still get to. If it can't be
+	// kept they have to be given up on now.
+	if(deferred && !defer(body, from, to, retry))
+	{
+		for(p = remote; p; p = p->nextRemote)
+		{
+			if(p->retry)
+				p->failed = true;
+		}
 	}
 
+	for(p = remote; p; p = p->nextRemote)
+	{
+		// If we couldn't send the message then bounce the message back to
+		// the sender. If we can't do this then log the fact and don't do anything
+		// else, because we do not want to get into a loop where we keep bouncing
+		// the message.
+		if(p->failed && !sendBounceMessage(body.data(), text_len, from, p, p->reason))
+		{
+			m_log.log(LOG_STATUS, "Sender::process_file(): Error sending bounce message to %s@%s (couldn't send to %s@%s)",
+				from->user, from->domain, p->user, p->domain);
+		}
+	}
 
-	fclose(fp);
 	unlink(filename);
+	delete[] delivered;
 	delete to;
 	delete from;
 	return;
@@ -321,83 +817,244 @@ error:
 		unlink(filename);
 }
 
-bool Sender::copyMessageToLocalMailbox(FILE* fp_sender, long endpos, const char* mailbox_dir) const
+bool Sender::defer(const FileMap & body, const Mailbox* from, const Mailbox* to, const SpoolRetry & retry)
 {
-	// BUFLEN is the size "chunk" we read and write to files. The bigger it is
-	// the less times we go to disk.
-	const size_t BUFLEN = 30000;
-	long bytesRead;
-	char buf[BUFLEN];
-	bool retval = false;
-	bool done = false;
+	SpoolRetry next = retry;
+	++next.attempts;
+
+	// Wait twice as long after each attempt, up to a limit.
+	time_t limit = m_options.retryInterval() > SENDER_MAX_RETRY_INTERVAL ?
+		m_options.retryInterval() : SENDER_MAX_RETRY_INTERVAL;
+	time_t wait = m_options.retryInterval();
+	for(unsigned int i = 1; i < next.attempts && wait < limit; ++i)
+		wait *= 2;
+	if(wait > limit)
+		wait = limit;
+
+	// Add or take up to a quarter, so messages that failed together aren't
+	// all tried again together.
+	wait += (time_t)(rand() % (wait / 2 + 1)) - wait / 4;
+
+	// Make the last attempt when the message's time is up.
+	next.next = time(NULL) + wait;
+	if(next.next > retry.first + (time_t)m_options.queueLifetime())
+		next.next = retry.first + (time_t)m_options.queueLifetime();
+
+	// commit hands the file back to schedule.
+	SpoolWriter writer(m_options, this);
+	bool rc = writer.open() && writer.writeRetry(next) &&
+		writer.writeSender(from->user, from->domain);
+
+	for(const Mailbox *p = to; p && rc; p = p->next)
+	{
+		if(p->retry)
+			rc = writer.writeRecipient(p->user, p->domain);
+	}
 
-	char *filename = NULL;
-	FILE *fp = newfile(mailbox_dir, "NEW", &filename);
+	rc = rc && writer.endEnvelope() && writer.write(body.data(), (unsigned int)body.size()) &&
+		writer.commit();
 
-	if(!fp)
+	if(!rc)
 	{
-		m_log.log(LOG_WARN, "Sender::copyMessageToLocalMailbox(): Could not create file in mailbox '%s'", mailbox_dir);
+		m_log.log(LOG_WARN, "Sender::defer(): Error writing retry file.");
+		writer.abort();
 		return false;
 	}
 
-	while((bytesRead = fread(buf, 1, BUFLEN, fp_sender)) > 0)
+	for(const Mailbox *p = to; p; p = p->next)
 	{
-		long curpos = ftell(fp_sender);
-		if(curpos >= endpos)
+		if(p->retry)
 		{
-			bytesRead -= (curpos - endpos);
-			done = true;
+			m_log.log(LOG_STATUS, "Sender::defer(): Couldn't send to %s@%s yet (attempt %u). Trying again in %ld seconds.",
+				p->user, p->domain, next.attempts, (long)(next.next - time(NULL)));
 		}
+	}
+
+	return true;
+}
 
-		if(bytesRead > 0)
+void Sender::schedule(const char* filename, time_t due)
+{
+	if(!wait_mutex(m_retryMutex))
+	{
+		m_log.log(LOG_WARN, "Sender::schedule(): Error while waiting for retry mutex. '%s' will be sent after a restart.", filename);
+		return;
+	}
+
+	if(m_retry_count == m_retry_size)
+	{
+		m_retry_size = m_retry_size ? m_retry_size * 2 : 64;
+		Retry *retries = new Retry[m_retry_size];
+		for(unsigned int i = 0; i < m_retry_count; ++i)
+			retries[i] = m_retries[i];
+		delete[] m_retries;
+		m_retries = retries;
+	}
+
+	// Add it at the bottom of the heap and move it up past the files due after it.
+	unsigned int i = m_retry_count++;
+	while(i > 0 && m_retries[(i - 1) / 2].due > due)
+	{
+		m_retries[i] = m_retries[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	m_retries[i].due = due;
+	m_retries[i].filename = strdupnew(filename);
+
+	release_mutex(m_retryMutex);
+}
+
+unsigned int Sender::enqueue_due()
+{
+	unsigned int count = 0;
+	time_t now = time(NULL);
+
+	if(!wait_mutex(m_retryMutex))
+		return 0;
+
+	while(m_retry_count > 0 && m_retries[0].due <= now)
+	{
+		char *filename = m_retries[0].filename;
+
+		// Move the last file down from the top of the heap to where it belongs.
+		Retry last = m_retries[--m_retry_count];
+		unsigned int i = 0;
+		for(;;)
 		{
-			if(fwrite(buf, 1, bytesRead, fp) != (size_t)bytesRead)
-			{
-				m_log.log(LOG_WARN, "Sender::copyMessageToLocalMailbox(): Error writing to '%s'", filename);
-				retval = false;
+			unsigned int child = 2 * i + 1;
+			if(child >= m_retry_count)
 				break;
-			}
+			if(child + 1 < m_retry_count && m_retries[child + 1].due < m_retries[child].due)
+				++child;
+			if(m_retries[child].due >= last.due)
+				break;
+			m_retries[i] = m_retries[child];
+			i = child;
 		}
+		m_retries[i] = last;
 
-		if((size_t)bytesRead != BUFLEN || done)
-			break;
+		if(enqueue(filename))
+			++count;
+		delete[] filename;
 	}
 
-	if(ferror(fp_sender))
-		m_log.log(LOG_WARN, "Sender::copyMessageToLocalMailbox(): Error while reading from sender file.");
+	release_mutex(m_retryMutex);
+	return count;
+}
 
-	if(ferror(fp))
-		m_log.log(LOG_WARN, "Sender::copyMessageToLocalMailbox(): Error while writing to '%s'", filename);
+// Fill fd, which is empty, with the len bytes of like without copying them
+// through memory: as a reflink where the file system supports them, or else
+// with copy_file_range. Returns false if neither works.
+static bool clone_file(const char* like, int fd, size_t len)
+{
+#ifdef __linux__
+	int src = open(like, O_RDONLY);
+	if(src == -1)
+		return false;
 
-	fclose(fp);
+	bool rc = false;
 
-	// Rename the file to have a MSG prefix instead of a NEW prefix. This indicates
-	// that the file is completely written out.
-	char *new_filename = strdupnew(filename);
-	char NEW_PREFIX[] = { DIR_DELIM, 'N', 'E', 'W', '\0' };
-	size_t len = strlen(new_filename);
+#ifdef FICLONE
+	rc = ioctl(fd, FICLONE, src) == 0;
+#endif
 
-	while(!retval && len--)
+#ifdef __NR_copy_file_range
+	if(!rc)
 	{
-		if(strncmp(NEW_PREFIX, new_filename + len, 4) == 0)
+		loff_t in = 0, out = 0;
+		size_t left = len;
+
+		while(left > 0)
 		{
-			memcpy(new_filename + len, "/MSG", 4);
-			retval = rename(filename, new_filename) == 0;
-			break;
+			long n = syscall(__NR_copy_file_range, src, &in, fd, &out, left, 0);
+			if(n <= 0)
+				break;
+			left -= n;
 		}
+
+		// Leave fd empty again for the caller to write instead.
+		rc = left == 0;
+		if(!rc && out > 0 && ftruncate(fd, 0) != 0)
+			rc = false;
+	}
+#endif
+
+	close(src);
+	return rc;
+#else
+	return false;
+#endif
+}
+
+bool Sender::copyMessageToLocalMailbox(const char* text, size_t len, const char* mailbox_dir,
+									   const char* like, char** pcopy) const
+{
+	char *filename = NULL;
+	FILE *fp = newfile(mailbox_dir, "NEW", &filename);
+
+	if(!fp)
+	{
+		m_log.log(LOG_WARN, "Sender::copyMessageToLocalMailbox(): Could not create file in mailbox '%s'", mailbox_dir);
+		return false;
 	}
 
+	// The file is renamed to have a MSG prefix instead of a NEW prefix once
+	// it is completely written out. The NEW file's name is unique, so the MSG
+	// one is too.
+	char *new_filename = strdupnew(filename);
+	char *name = strrchr(new_filename, DIR_DELIM);
+	name = name ? name + 1 : new_filename;
+	memcpy(name, "MSG", 3);
+
+#ifndef WIN32
+	// Mailbox files are never changed, so mailboxes on the same file system
+	// can all have the same file.
+	if(like && link(like, new_filename) == 0)
+	{
+		fclose(fp);
+		unlink(filename);
+		delete[] filename;
+		delete[] new_filename;
+		return true;
+	}
+#endif
+
+	bool written = (like && clone_file(like, fileno(fp), len)) ||
+		fwrite(text, 1, len, fp) == len;
+
+	if(fclose(fp) != 0 || !written)
+	{
+		m_log.log(LOG_WARN, "Sender::copyMessageToLocalMailbox(): Error writing to '%s'", filename);
+		unlink(filename);
+		delete[] filename;
+		delete[] new_filename;
+		return false;
+	}
+
+	bool retval = rename(filename, new_filename) == 0;
+	if(!retval)
+		unlink(filename);
+
 	delete[] filename;
-	delete[] new_filename;
+
+	if(retval && pcopy)
+		*pcopy = new_filename;
+	else
+		delete[] new_filename;
 
 	return retval;
 }
 
-bool Sender::sendMessageToRemoteMailbox(FILE* fp,
+bool Sender::sendMessageToRemoteMailbox(const char* text, size_t len,
 										const Mailbox* from,
 										const Mailbox* to,
-										REASON_FAILED & reason) const
+										REASON_FAILED & reason,
+										bool & retry) const
 {
+	// The server may be back later.
+	retry = true;
+
 	// Lookup the MX entry for the domain to find the address of the SMTP server.
 	char *exchanger = 0;
 	if(!dns_resolve_mx_to_addr(to->domain, &exchanger))
@@ -436,7 +1093,7 @@ bool Sender::sendMessageToRemoteMailbox(FILE* fp,
 
 	Socket sock(s);
 
-	bool retval = sendMessage(sock, fp, from, to, reason);
+	bool retval = sendMessage(sock, text, len, from, to, reason, retry);
 
 	sock.close();
 
@@ -444,7 +1101,8 @@ bool Sender::sendMessageToRemoteMailbox(FILE* fp,
 }
 
 // This function sends "bounce" RFC 3462 formatted message.
-FILE* Sender::createBounceMessage(FILE *fp_original_message,
+FILE* Sender::createBounceMessage(const char* text,
+								  size_t len,
 								  char **pFilename,
 								  const Mailbox *from,
 								  const Mailbox *unreachable,
@@ -455,31 +1113,6 @@ FILE* Sender::createBounceMessage(FILE *fp_original_message,
 	char *filename = NULL;
 	const char* boundary = "===========================_ _= 4183769(29875)5809016839";
 
-	int c;
-	long endpos;
-	long startpos;
-
-	startpos = ftell(fp_original_message);
-
-	if(startpos == -1)
-		return NULL;
-
-	if(fseek(fp_original_message, 0, SEEK_END) != 0)
-		return NULL;
-
-	endpos = ftell(fp_original_message);
-
-	if(endpos == -1)
-		return NULL;
-
-	endpos -= 5; // Move back past the last <CRLF>.<CRLF>.
-
-	if(endpos < 0)
-		return NULL;
-
-	if(fseek(fp_original_message, startpos, SEEK_SET) != 0)
-		return NULL;
-
 	if(!get_rfc_2822_datetime(time(NULL), datetime, sizeof(datetime)))
 		return NULL;
 
@@ -605,12 +1238,9 @@ FILE* Sender::createBounceMessage(FILE *fp_original_message,
 		boundary, CRLF, CRLF, CRLF) < 0)
 		goto write_error;
 
-	while(ftell(fp_original_message) <= endpos && (c = getc(fp_original_message)) != EOF)
-	{
-		if(putc(c, fp) != c)
-			goto write_error;
-	}
-	
+	if(fwrite(text, 1, len, fp) != len)
+		goto write_error;
+
 	// End in <CRLF>.<CRLF> since this will be sent by the send message routine.
 	if(fprintf(fp, "%s--%s%s.%s", CRLF, boundary, CRLF, CRLF) < 0)
 		goto write_error;
@@ -630,7 +1260,8 @@ write_error:
 	return NULL;
 }
 
-bool Sender::sendBounceMessage(FILE *fp_og_message,
+bool Sender::sendBounceMessage(const char* text,
+							   size_t len,
 							   const Mailbox *from,
 							   const Mailbox *unreachable,
 							   REASON_FAILED reason)
@@ -638,14 +1269,17 @@ bool Sender::sendBounceMessage(FILE *fp_og_message,
 {
 	// Create the bounce message.
 	char *filename = NULL;
-	FILE *fp_bounce_message = createBounceMessage(fp_og_message, &filename, from, unreachable, reason);
+	FileMap bounce;
+	FILE *fp_bounce_message = createBounceMessage(text, len, &filename, from, unreachable, reason);
 	if(!fp_bounce_message)
 		return false;
 
 	Mailbox postmaster(NULL, "Postmaster", from->domain);
 
 	REASON_FAILED dont_care;
-	if(!sendMessageToRemoteMailbox(fp_bounce_message, &postmaster, from, dont_care))
+	bool dont_retry;
+	if(!bounce.open(fp_bounce_message, 0) ||
+		!sendMessageToRemoteMailbox(bounce.data(), bounce.size(), &postmaster, from, dont_care, dont_retry))
 		goto failed;
 
 	fclose(fp_bounce_message);
@@ -665,7 +1299,21 @@ failed:
 	return false;
 }
 
-bool Sender::sendMessage(Socket & s, FILE *fp, const Mailbox* from, const Mailbox* to, REASON_FAILED &reason) const
+// Returns true if reply has the code expected. Otherwise retry is cleared if
+// the reply says the failure is permanent.
+static bool reply_is(const char* reply, int expected, bool & retry)
+{
+	int code = atoi(reply);
+	if(code == expected)
+		return true;
+
+	if(code >= 500 && code < 600)
+		retry = false;
+
+	return false;
+}
+
+bool Sender::sendMessage(Socket & s, const char* text, size_t len, const Mailbox* from, const Mailbox* to, REASON_FAILED &reason, bool & retry) const
 {
 	try
 	{
@@ -674,14 +1322,14 @@ bool Sender::sendMessage(Socket & s, FILE *fp, const Mailbox* from, const Mailbo
 		if(!s.getLine(command, sizeof command, NULL))
 			return false;
 
-		if(atoi(command) != 220)
+		if(!reply_is(command, 220, retry))
 			return false;
 
 		s.putLine("HELO");
 		if(!s.getLine(command, sizeof command, NULL))
 			return false;
 
-		if(atoi(command) != 250)
+		if(!reply_is(command, 250, retry))
 			return false;
 
 		safe_snprintf(command, sizeof command, "MAIL FROM: <%s@%s>", from->user, from->domain);
@@ -690,7 +1338,7 @@ bool Sender::sendMessage(Socket & s, FILE *fp, const Mailbox* from, const Mailbo
 		if(!s.getLine(command, sizeof command, NULL))
 			return false;
 
-		if(atoi(command) != 250)
+		if(!reply_is(command, 250, retry))
 		{
 			reason = RF_REJECTED_MAIL_FROM;
 			return false;
@@ -705,7 +1353,7 @@ bool Sender::sendMessage(Socket & s, FILE *fp, const Mailbox* from, const Mailbo
 			return false;
 		}
 
-		if(atoi(command) != 250)
+		if(!reply_is(command, 250, retry))
 			return false;
 
 		s.putLine("DATA");
@@ -713,32 +1361,18 @@ bool Sender::sendMessage(Socket & s, FILE *fp, const Mailbox* from, const Mailbo
 		if(!s.getLine(command, sizeof command, NULL))
 			return false;
 
-		if(atoi(command) != 354)
-			return false;
-
-		// BUFLEN is the size "chunk" we read from files. The bigger it is
-		// the less times we go to disk.
-		const size_t BUFLEN = 30000;
-		char readBuf[BUFLEN];
-		size_t bytesRead;
-
-		while((bytesRead = fread(readBuf, 1, sizeof(readBuf), fp)) > 0)
-			s.send(readBuf, bytesRead);
-
-		if(!s.getLine(command, sizeof command, NULL))
-			return false;
-
-		if(atoi(command) != 250)
+		if(!reply_is(command, 354, retry))
 			return false;
 
-		s.putLine("QUIT");
+		// The text is in wire format, ending with <CRLF>.<CRLF>, so it goes
+		// as it is.
+		s.send(text, (int)len);
 
 		if(!s.getLine(command, sizeof command, NULL))
 			return false;
 
-		if(atoi(command) != 221)
+		if(!reply_is(command, 250, retry))
 			return false;
-
 	}
 	catch(SocketError & e)
 	{
@@ -746,81 +1380,213 @@ bool Sender::sendMessage(Socket & s, FILE *fp, const Mailbox* from, const Mailbo
 		return false;
 	}
 
-	return true;
-}
-
-void Sender::Run()
-{
-	// Reinitialize the semaphore and mutex for this Run.
-	if(m_bFileListSemCreated)
+	// The message has been delivered, so whatever happens with QUIT it must
+	// not be sent again.
+	try
 	{
-		delete_semaphore(m_fileListSemaphore);
-		m_bFileListSemCreated = false;
-	}
+		char reply[SMTP_MAX_REPLY_LENGTH];
 
-	if(m_bFileListMutexCreated)
-	{
-		delete_mutex(m_fileListMutex);
-		m_bFileListMutexCreated = false;
+		s.putLine("QUIT");
+		if(s.getLine(reply, sizeof reply, NULL) && atoi(reply) != 221)
+			m_log.log(LOG_STATUS, "Sender::sendMessage(): Unexpected reply to QUIT from %s: %s", to->domain, reply);
 	}
-
-	if(m_bFileListEmptySemCreated)
+	catch(SocketError &)
 	{
-		delete_semaphore(m_fileListEmptySemaphore);
-		m_bFileListEmptySemCreated = false;
 	}
 
+	return true;
+}
+
+bool Sender::Start()
+{
+	if(m_run)
+		return false;
+
 	if(create_semaphore(m_fileListSemaphore))
 		m_bFileListSemCreated = true;
 	else
 	{
-		m_log.log(LOG_WARN, "Sender::Run(): Could not create file list semaphore. Sender exiting.");
-		return;
+		m_log.log(LOG_ERROR, "Sender::Start(): Could not create file list semaphore.");
+		return false;
 	}
 
 	if(create_mutex(m_fileListMutex))
 		m_bFileListMutexCreated = true;
 	else
 	{
-		m_log.log(LOG_WARN, "Sender::Run(): Could not create file list mutex. Sender exiting.");
-		return;
+		m_log.log(LOG_ERROR, "Sender::Start(): Could not create file list mutex.");
+		return false;
 	}
 
-	if(create_semaphore(m_fileListEmptySemaphore))
-		m_bFileListEmptySemCreated = true;
+	if(create_semaphore(m_exitSemaphore))
+		m_bExitSemCreated = true;
 	else
 	{
-		m_log.log(LOG_WARN, "Sender::Run(): Could not create file list empty semaphore. Sender exiting.");
-		return;
+		m_log.log(LOG_ERROR, "Sender::Start(): Could not create exit semaphore.");
+		return false;
 	}
-	
-	// Start the Run.
+
+	if(create_mutex(m_retryMutex))
+		m_bRetryMutexCreated = true;
+	else
+	{
+		m_log.log(LOG_ERROR, "Sender::Start(): Could not create retry mutex.");
+		return false;
+	}
+
+	// For the jitter in retry times.
+	srand((unsigned int)time(NULL));
+
+#ifdef SENDER_INOTIFY
+	// Start watching before looking through the directory, so no file can
+	// be missed in between.
+	m_watch_fd = inotify_init1(IN_CLOEXEC);
+	if(m_watch_fd != -1 && inotify_add_watch(m_watch_fd, m_options.sendDir(), IN_MOVED_TO | IN_CLOSE_WRITE) == -1)
+	{
+		close(m_watch_fd);
+		m_watch_fd = -1;
+	}
+
+	if(m_watch_fd == -1)
+		m_log.log(LOG_WARN, "Sender::Start(): Could not watch the send directory. It will be scanned every %u seconds instead.", m_options.scanInterval());
+#endif
+
+	// Pick up what an earlier run left behind.
+	unsigned int queued = build_list();
+	if(queued > 0)
+		m_log.log(LOG_STATUS, "Sender::Start(): Queued %u files left in the send directory.", queued);
+
+	unsigned int scheduled = build_list("RTY");
+	if(scheduled > 0)
+		m_log.log(LOG_STATUS, "Sender::Start(): %u files are waiting to be tried again.", scheduled);
+
 	m_run = true;
-	signal_semaphore(m_fileListEmptySemaphore);
 
-	unsigned int count = m_options.senderThreads();
-	for(unsigned int i = 0; i < count; ++i)
+	for(unsigned int i = 0; i < m_options.senderThreads(); ++i)
 	{
-		if(!create_thread(thread_routine, this))
-			m_log.log(LOG_WARN, "Sender::Run(): Error creating sending thread #%u", i);
+		if(create_thread(thread_routine, this))
+			++m_thread_count;
+		else
+			m_log.log(LOG_WARN, "Sender::Start(): Error creating sending thread #%u", i);
 	}
 
-	while(wait_semaphore(m_fileListEmptySemaphore))
+	if(m_thread_count == 0)
 	{
-		// When the list is empty scan the directory every 5 seconds
-		// for new e-mails.
-		while(m_run && !build_list())
-			sleep(m_options.scanInterval());
+		m_log.log(LOG_ERROR, "Sender::Start(): Could not create any sending threads.");
+		m_run = false;
+		return false;
+	}
 
-		if(!m_run)
-			break;
+	m_exit_count = m_thread_count;
+
+	if(create_thread(watch_routine, this))
+		++m_exit_count;
+	else
+		m_log.log(LOG_WARN, "Sender::Start(): Error creating the send directory watch thread. Only mail from the SMTP server will be sent.");
+
+	return true;
+}
+
+THREAD_RETTYPE WINAPI Sender::watch_routine(void* pData)
+{
+	Sender *pThis = (Sender*)pData;
+
+	if(pThis->m_watch_fd == -1 || !pThis->watch())
+	{
+		// Without a watch, look for new files every scan_interval seconds.
+		while(pThis->m_run)
+		{
+			sleep(pThis->m_options.scanInterval());
+
+			if(pThis->m_run)
+			{
+				pThis->build_list();
+				pThis->enqueue_due();
+			}
+		}
+	}
+
+	signal_semaphore(pThis->m_exitSemaphore);
+	return 0;
+}
+
+bool Sender::watch()
+{
+#ifdef SENDER_INOTIFY
+	// Room for plenty of events, aligned for struct inotify_event.
+	union
+	{
+		struct inotify_event event;
+		char buf[64 * 1024];
+	} u;
+
+	while(m_run)
+	{
+		struct pollfd pfd;
+		pfd.fd = m_watch_fd;
+		pfd.events = POLLIN;
+
+		// Wake up every second to see if the sender has been stopped, and
+		// for the retry files that have come due.
+		int rc = poll(&pfd, 1, 1000);
+		ssize_t len = 0;
+
+		enqueue_due();
+
+		if(rc > 0)
+			len = read(m_watch_fd, u.buf, sizeof u.buf);
+
+		if(rc < 0 || len < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			m_log.log(LOG_WARN, "Sender::watch(): Error watching the send directory. It will be scanned every %u seconds instead.", m_options.scanInterval());
+			return false;
+		}
+
+		for(char *p = u.buf; p < u.buf + len; )
+		{
+			const struct inotify_event *event = (const struct inotify_event*)p;
+			p += sizeof(struct inotify_event) + event->len;
+
+			// Events were lost, so go through the whole directory.
+			if(event->mask & IN_Q_OVERFLOW)
+			{
+				build_list();
+				continue;
+			}
+
+			// Only MSGxxx files are complete.
+			if(event->len > 0 && strncmp(event->name, "MSG", 3) == 0)
+			{
+				char filename[MAX_PATH + 1];
+				safe_snprintf(filename, sizeof filename, "%s%c%s", m_options.sendDir(), DIR_DELIM, event->name);
+				enqueue(filename);
+			}
+		}
 	}
+
+	return true;
+#else
+	return false;
+#endif
 }
 
 void Sender::Stop()
 {
+	if(!m_run)
+		return;
+
 	m_run = false;
-	signal_semaphore(m_fileListEmptySemaphore);
+
+	// Wake up every thread so it sees m_run is false.
+	for(unsigned int i = 0; i < m_thread_count; ++i)
+		signal_semaphore(m_fileListSemaphore);
+
+	// They use the Sender until the end, so it can't be deleted before then.
+	for(unsigned int i = 0; i < m_exit_count; ++i)
+		wait_semaphore(m_exitSemaphore);
 }
 
 #ifndef WIN32
@@ -831,22 +1597,15 @@ static int glob_err_func(const char* filename, int error_code)
 }
 #endif
 
-bool Sender::build_list()
+unsigned int Sender::build_list(const char* prefix)
 {
-	if(!wait_mutex(m_fileListMutex))
-	{
-		m_log.log(LOG_WARN, "Sender::build_list(): Error while waiting for file list mutex.");
-		return false;
-	}
-
-	delete m_pfiles;
-	m_pfiles = 0;
+	unsigned int count = 0;
 
 #ifdef WIN32
 	WIN32_FIND_DATA findData;
 	char buf[MAX_PATH + 1];
 
-	safe_snprintf(buf, sizeof buf, "%s/MSG*", m_options.sendDir());
+	safe_snprintf(buf, sizeof buf, "%s/%s*", m_options.sendDir(), prefix);
 	HANDLE h = FindFirstFile(buf, &findData);
 	if(h != INVALID_HANDLE_VALUE)
 	{
@@ -857,8 +1616,8 @@ bool Sender::build_list()
 			{
 				safe_snprintf(buf, sizeof buf, "%s%c%s",
 					m_options.sendDir(), DIR_DELIM, findData.cFileName);
-				m_pfiles = new FileList(m_pfiles, buf);
-				signal_semaphore(m_fileListSemaphore);
+				if(queue_file(buf))
+					++count;
 			}
 		} while(FindNextFile(h, &findData));
 
@@ -869,7 +1628,7 @@ bool Sender::build_list()
 	char buf[MAX_PATH + 1];
 	
 	memset(&g, 0, sizeof(g));
-	safe_snprintf(buf, sizeof buf, "%s/MSG*", m_options.sendDir());
+	safe_snprintf(buf, sizeof buf, "%s/%s*", m_options.sendDir(), prefix);
 
 	if(glob(buf, 0, glob_err_func, &g) == 0)
 	{
@@ -879,8 +1638,8 @@ bool Sender::build_list()
 			struct stat s;
 			if(stat(buf, &s) == 0 && !S_ISDIR(s.st_mode))
 			{
-				m_pfiles = new FileList(m_pfiles, buf);
-				signal_semaphore(m_fileListSemaphore);
+				if(queue_file(buf))
+					++count;
 			}
 		}
 	}
@@ -888,9 +1647,35 @@ bool Sender::build_list()
 	globfree(&g);
 #endif
 
-	bool rc = m_pfiles != NULL;
+	return count;
+}
 
-	release_mutex(m_fileListMutex);
+bool Sender::queue_file(const char* filename)
+{
+	const char *name = strrchr(filename, DIR_DELIM);
+	name = name ? name + 1 : filename;
 
-	return rc;
+	if(strncmp(name, "RTY", 3) != 0)
+		return enqueue(filename);
+
+	// Find out when it is due. If that can't be read it is sent now, which
+	// will sort it out.
+	SpoolRetry retry;
+	retry.next = 0;
+
+	FILE *fp = fopen(filename, "rb");
+	if(fp)
+	{
+		unsigned char buf[SPOOL_HEADER_SIZE + SPOOL_RETRY_SIZE];
+		SpoolHeader header;
+
+		if(fread(buf, 1, sizeof buf, fp) == sizeof buf && spool_header_decode(buf, header) &&
+			(header.flags & SPOOL_FLAG_RETRY))
+			spool_retry_decode(buf + SPOOL_HEADER_SIZE, retry);
+
+		fclose(fp);
+	}
+
+	schedule(filename, retry.next);
+	return true;
 }
@@ -35,6 +35,10 @@
 #include "options.h"
 #include "accounts.h"
 #include "thread.h"
+#include "spool_file.h"
+#include <time.h>
+
+class FileMap;
 
 enum REASON_FAILED
 {
@@ -45,27 +49,98 @@ enum REASON_FAILED
 	RF_UNKNOWN
 };
 
+// The number of hash chains in the set of files the sender knows about.
+#define SENDER_FILE_BUCKETS 4096
+
+// The number of hash chains in the set of domains that have files queued.
+#define SENDER_DOMAIN_BUCKETS 1024
+
+// The room for a domain name the sender queues files by, including the NULL
+// terminator. Longer ones are all queued together.
+#define SENDER_MAX_DOMAIN 256
+
+// The longest the sender waits between attempts to send a message, in
+// seconds, unless retry_interval is longer.
+#define SENDER_MAX_RETRY_INTERVAL (4 * 60 * 60)
+
 class Sender
 {
 	Log m_log;
 	Options m_options;
 	const Accounts & m_accounts;
-	bool m_run;
-	SEMAPHORE m_fileListSemaphore;
+	volatile bool m_run;
+	unsigned int m_thread_count; // The sender threads running.
+	unsigned int m_exit_count; // The threads, including the watch thread, Stop waits for.
+	SEMAPHORE m_exitSemaphore; // Signaled by each thread as it exits.
+	bool m_bExitSemCreated;
+	SEMAPHORE m_fileListSemaphore; // Signaled once for each file added to a queue.
 	bool m_bFileListSemCreated;
-	MUTEX m_fileListMutex;
+	MUTEX m_fileListMutex; // Guards m_known, m_domains and the ready list.
 	bool m_bFileListMutexCreated;
-	SEMAPHORE m_fileListEmptySemaphore;
-	bool m_bFileListEmptySemCreated;
 
+	struct DomainQueue;
+
+	// A file waiting to be sent.
 	struct FileList
 	{
 		FileList *next;
+		FileList *hashNext; // The next file in the same chain of m_known.
 		char* filename;
+		const char* name; // The part of filename after the directory.
+		unsigned int hash; // The hash of name.
+		DomainQueue *domain; // The queue it was put in, or NULL.
 
 		FileList(FileList * newNext, const char* filename);
 		~FileList();
-	} *m_pfiles;
+	};
+
+	// The files waiting to be sent to one domain, oldest first. A file is
+	// queued by the domain of its first recipient.
+	struct DomainQueue
+	{
+		DomainQueue *hashNext; // The next domain in the same chain of m_domains.
+		DomainQueue *readyNext; // The next domain in the ready list.
+		char* name; // In lower case.
+		unsigned int hash; // The hash of name.
+		FileList *head, *tail;
+		unsigned int sending; // The number of its files being sent.
+		bool ready; // True if it is in the ready list.
+
+		DomainQueue(const char* newName, unsigned int newHash);
+		~DomainQueue();
+	};
+
+	// The domains that have files queued or being sent.
+	DomainQueue *m_domains[SENDER_DOMAIN_BUCKETS];
+
+	// The domains a thread can take a file from: those with files queued
+	// and fewer than domain_threads of them being sent. A thread takes a
+	// file from the first and moves it to the back, so the domains take
+	// turns, and a big batch of mail for one domain doesn't hold up mail for
+	// the others.
+	DomainQueue *m_ready_head, *m_ready_tail;
+
+	// Find domain's queue, creating it if there isn't one.
+	DomainQueue* find_domain(const char* domain);
+
+	// Put d at the back of the ready list if a thread may take a file from it.
+	void make_ready(DomainQueue* d);
+
+	// Take the oldest file of the first domain in the ready list. Returns
+	// NULL if no domain is ready.
+	FileList* take();
+
+	// Read the domain of the first recipient of the spool file filename into
+	// domain, which has room for size bytes. Returns false if it can't be
+	// read, as for the text files written by older versions.
+	bool read_domain(const char* filename, char* domain, unsigned int size) const;
+
+	// Every file that is in the list or being sent, so that a file the SMTP
+	// server queued isn't queued again when the send directory watch sees it.
+	// Only access it after acquiring m_fileListMutex.
+	FileList *m_known[SENDER_FILE_BUCKETS];
+
+	int m_watch_fd; // The inotify instance watching the send directory, or -1.
 
 	struct Mailbox
 	{
@@ -78,28 +153,101 @@ class Sender
 		char *user; // Username
 		char *domain; // Domain name
 		bool failed; // True if a failure occurred while trying to deliver message.
+		bool retry; // True if sending failed but may work if tried again later.
+		REASON_FAILED reason; // Why sending failed.
 
 		Mailbox(Mailbox *newNext, const char* newUser, const char* newDomain);
 		~Mailbox();
 	};
 
-	// Build a list of files to process. Returns true if it added one or more
-	// files to the list and false if it did not.
-	bool build_list();
+	// Queue the files in the send directory that aren't queued yet. Returns
+	// the number queued. This is done at startup, to pick up the files left
+	// by an earlier run, and then only when the send directory can't be
+	// watched. The SMTP server queues the files it writes itself. With an
+	// RTY prefix the retry files are scheduled instead.
+	unsigned int build_list(const char* prefix = "MSG");
+
+	// Queue a file build_list found, or schedule it if it is a retry file.
+	bool queue_file(const char* filename);
+
+	// A retry file waiting for its time to come.
+	struct Retry
+	{
+		time_t due;
+		char *filename;
+	};
+
+	// The retry files, in a heap ordered by due time so the earliest is
+	// m_retries[0]. Sending threads only see a retry file once it is due, so
+	// a queue full of messages for servers that are down costs nothing.
+	// Only access it after acquiring m_retryMutex.
+	Retry *m_retries;
+	unsigned int m_retry_count;
+	unsigned int m_retry_size; // The room in m_retries.
+	MUTEX m_retryMutex;
+	bool m_bRetryMutexCreated;
+
+	// Queue the retry files that are due. Returns the number queued.
+	unsigned int enqueue_due();
 
-	// The thread routine.
-	static THREAD_RETTYPE WINAPI thread_routine(void* pThis);
+	// Write the recipients in to that are marked retry to a retry file, to
+	// be tried again after a wait that grows with each attempt. retry is
+	// what the file being sent said about earlier attempts. Returns false
+	// on error.
+	bool defer(const FileMap & body, const Mailbox* from, const Mailbox* to, const SpoolRetry & retry);
+
+	// Forget p once its file has been sent, and delete it. That lets a thread
+	// take another file of its domain if domain_threads held it back.
+	void finished(FileList *p);
+
+	// The thread routine. pData is the Sender.
+	static THREAD_RETTYPE WINAPI thread_routine(void* pData);
+
+	// Queue the files that other programs put in the send directory, and the
+	// retry files as they come due.
+	static THREAD_RETTYPE WINAPI watch_routine(void* pThis);
+
+	// Queue the send directory files m_watch_fd reports until the sender is
+	// stopped. Returns false if the watch stops working.
+	bool watch();
 
 	// Process a sendDir file and put it in it's mailbox or send it
 	// to another SMTP server.
 	void process_file(const char* filename);
 
-	bool copyMessageToLocalMailbox(FILE* fp, long endpos, const char* mailbox_dir) const;
-	bool sendMessageToRemoteMailbox(FILE* fp, const Mailbox* from, const Mailbox* to, REASON_FAILED & reason) const;
-	FILE* createBounceMessage(FILE *fp_original_message, char **pFilename,
+	// Read the mailboxes from the spool file fp, prepending the recipients to
+	// to, and find where the message starts (body) and where the text for
+	// local mailboxes ends (endpos). Returns false on error, setting
+	// incomplete if the file may still be being written.
+	// retry is filled in from a retry file's retry record; otherwise this is
+	// the first attempt.
+	bool readEnvelope(FILE* fp, const char* filename, Mailbox*& from, Mailbox*& to,
+		long & body, long & endpos, SpoolRetry & retry, bool & incomplete) const;
+
+	// readEnvelope for the text files written by older versions.
+	bool readTextEnvelope(FILE* fp, const char* filename, Mailbox*& from, Mailbox*& to,
+		long & body, long & endpos, bool & incomplete) const;
+
+	// The message text is passed in memory, so it is read once for all of
+	// the recipients. text is the body from the spool file: for local
+	// mailboxes without the terminating <CRLF>.<CRLF>, and for remote ones
+	// with it.
+	// copyMessageToLocalMailbox gives the mailbox a link to like, if it isn't
+	// NULL, instead of a copy of its own. like is a file in another mailbox
+	// that already has the message. If a new copy had to be written, *pcopy
+	// is set to its name, which the caller must delete[].
+	bool copyMessageToLocalMailbox(const char* text, size_t len, const char* mailbox_dir,
+		const char* like, char** pcopy) const;
+	// When sending fails, retry is set if the failure may be temporary: the
+	// server couldn't be found or reached, dropped the connection, or gave
+	// a 4xx reply.
+	bool sendMessageToRemoteMailbox(const char* text, size_t len, const Mailbox* from, const Mailbox* to,
+		REASON_FAILED & reason, bool & retry) const;
+	FILE* createBounceMessage(const char* text, size_t len, char **pFilename,
 								const Mailbox *from, const Mailbox *unreachable, REASON_FAILED reason) const;
-	bool sendBounceMessage(FILE *fp, const Mailbox *from, const Mailbox *unreachable, REASON_FAILED reason) const;
-	bool sendMessage(Socket & s, FILE* fp, const Mailbox* from, const Mailbox* to, REASON_FAILED & reason) const;
+	bool sendBounceMessage(const char* text, size_t len, const Mailbox *from, const Mailbox *unreachable, REASON_FAILED reason) const;
+	bool sendMessage(Socket & s, const char* text, size_t len, const Mailbox* from, const Mailbox* to,
+		REASON_FAILED & reason, bool & retry) const;
 
 	const Sender & operator=(const Sender &);
 
@@ -107,11 +255,23 @@ public:
 	Sender(const Options & options, const Accounts & accounts);
 	~Sender();
 
-	// Start the sender monitor.
-	void Run();
+	// Queue the files already in the send directory and start the sender
+	// threads. Returns false on error.
+	bool Start();
 
-	// Stop the sender monitor.
+	// Stop the sender threads, and wait for them to exit. A thread in the
+	// middle of sending a file finishes it first.
 	void Stop();
+
+	// Queue a file in the send directory to be sent. domain is the domain of
+	// its first recipient, or NULL to read it from the file. Can be called
+	// from any thread. Returns false if the file is already queued or being
+	// sent.
+	bool enqueue(const char* filename, const char* domain = NULL);
+
+	// Queue the retry file filename to be sent again at due. Can be called
+	// from any thread.
+	void schedule(const char* filename, time_t due);
 };
 
 #endif
@@ -30,8 +30,11 @@
 #include "server.h"
 #include "utility.h"
 #include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <new>
 
 static bool matchtoken(char** str, const char* strtomatch)
 {
@@ -42,34 +45,35 @@ static bool matchtoken(char** str, const char* strtomatch)
 	return strcasecmp(buf, strtomatch) == 0;
 }
 
-static bool mailpath(char **ppath, char **local_part, char **domain_part)
+// The mailbox is split up in buf, which must hold SMTP_MAX_TEXT_LINE + 1
+// characters, and local_part and domain_part point into it.
+static bool mailpath(char **ppath, char *buf, char **local_part, char **domain_part)
 {
 	if(!ppath)
 		return false;
 
 	char* path = *ppath;
-	char sender[SMTP_MAX_TEXT_LINE + 1];
 
 	// Get all characters until the next '>'.
 	int i;
 	for(i = 0; i < SMTP_MAX_TEXT_LINE && path[i] && path[i] != '>'; ++i)
 	{
-		sender[i] = path[i];
+		buf[i] = path[i];
 	}
 
-	sender[i] = 0;
+	buf[i] = 0;
 
 	*ppath = path + i;
 
 	// Remove the source routes from the sender address.
-	char *mailbox = strrchr(sender, ':');
+	char *mailbox = strrchr(buf, ':');
 	if(mailbox == NULL)
-		mailbox = sender;
+		mailbox = buf;
 	else
 		++mailbox;
 
 	// Make sure the mailbox is syntaxtically correct.
-	return mailbox_ok(mailbox, local_part, domain_part);
+	return mailbox_split(mailbox, local_part, domain_part);
 }
 
 
@@ -83,11 +87,6 @@ domain_part(0)
 {
 }
 
-Server::Mailbox::~Mailbox()
-{
-	clear();
-}
-
 const char* Server::Mailbox::getLocal() const
 {
 	return local_part;
@@ -98,21 +97,15 @@ const char* Server::Mailbox::getDomain() const
 	return domain_part;
 }
 
-void Server::Mailbox::setPath(const char* newLocal, const char* newDomain)
+void Server::Mailbox::setPath(Arena & arena, const char* newLocal, const char* newDomain)
 {
-	delete[] local_part;
-	local_part = strdupnew(newLocal);
-
-	delete[] domain_part;
-	domain_part = strdupnew(newDomain);
+	local_part = arena.copy(newLocal);
+	domain_part = arena.copy(newDomain);
 }
 
 void Server::Mailbox::clear()
 {
-	delete[] local_part;
 	local_part = 0;
-
-	delete[] domain_part;
 	domain_part = 0;
 }
 
@@ -126,11 +119,6 @@ Server::ToList::ToList()
 {
 }
 
-Server::ToList::~ToList()
-{
-	delete next;
-}
-
 bool Server::ToList::isSet()
 {
 	return this != NULL;
@@ -138,142 +126,228 @@ bool Server::ToList::isSet()
 
 Server::Message::Message()
 :to(0),
-data(0)
+size(0)
 {
 }
 
-Server::Message::~Message()
-{
-	reset();
-}
-
 void Server::Message::add_recipient(const char* localpart, const char* domainpart)
 {
-	if(!to)
-		to = new ToList();
-	else
-	{
-		ToList *n = new ToList();
-		n->next = to;
-		to = n;
-	}
+	ToList *n = new(arena.alloc(sizeof(ToList))) ToList();
+	n->next = to;
+	to = n;
 
-	to->recipient.setPath(localpart, domainpart);
+	to->recipient.setPath(arena, localpart, domainpart);
 }
 
 void Server::Message::reset()
 {
 	from.clear();
-
-	delete[] data;
-	delete to;
-
-	data = 0;
 	to = 0;
+	size = 0;
+	arena.reset();
 }
 
-Server::Server(SOCKET s, const Accounts & accounts, const Options & options)
+// resume reads at most this many times before giving the other sessions a turn.
+// The reactor reports the socket again straight away if there is more to read.
+#define SERVER_MAX_READS 16
+
+// resume stops reading commands while the client leaves this little room in
+// the send buffer, so a client that never reads its replies can't make the
+// server queue them without limit.
+#define SERVER_MIN_SEND_SPACE (SMTP_MAX_REPLY_LENGTH * 2)
+
+Server::Server(SOCKET s, const Accounts & accounts, const Options & options, Sender & sender)
 : m_sock(s),
 m_accounts(accounts),
-m_options(options)
+m_options(options),
+m_state(SS_GREETING),
+m_spool(options, &sender),
+m_data_error(0),
+m_data_size(0),
+m_scanner(SMTP_MAX_TEXT_LINE),
+m_chunk_size(0),
+m_chunk_remaining(0),
+m_chunk_last(false)
 {
 }
 
 Server::~Server()
 {
-	m_sock.close();
+	if(m_sock.sock != INVALID_SOCKET)
+		m_sock.close();
+}
+
+void Server::detach()
+{
+	m_sock.sock = INVALID_SOCKET;
 }
 
-int Server::run()
+Server::RESUME_STATUS Server::resume()
 {
 	try
 	{
-		bool done = false;
-		reply(220);
-
-		while(!done)
+		if(m_state == SS_GREETING)
 		{
-			char command_line[SMTP_MAX_COMMAND_LENGTH];
-			char *pcmd_line = command_line;
-			char command[SMTP_MAX_COMMAND_LENGTH];
+			reply(220);
+			m_state = SS_COMMAND;
+		}
+		else if(m_state == SS_COMMIT)
+		{
+			// The SpoolCommitter is done with the spool file.
+			reply(m_spool.committed() ? 250 : 452);
+			m_state = SS_COMMAND;
+		}
 
-			if(!m_sock.getLine(pcmd_line, sizeof command_line, NULL))
-			{
-				reply(500, "Line too long");
-				continue;
-			}
+		int reads = 0;
 
-			if(!nexttoken(&pcmd_line, command, sizeof command))
+		while(m_state != SS_QUIT)
+		{
+			if(m_state == SS_COMMIT)
 			{
-				reply(500);
-				continue;
+				// Send the replies so far while the message is committed.
+				m_sock.flushSome();
+				return RS_WANT_COMMIT;
 			}
 
-			if(strcasecmp("HELO", command) == 0)
-			{
-				helo(pcmd_line);
-			}
-			else if(strcasecmp("EHLO", command) == 0)
-			{
-				ehlo(pcmd_line);
-			}
-			else if(strcasecmp("MAIL", command) == 0)
-			{
-				mail(pcmd_line);
-			}
-			else if(strcasecmp("RCPT", command) == 0)
-			{
-				rcpt(pcmd_line);
-			}
-			else if(strcasecmp("DATA", command) == 0)
-			{
-				data(pcmd_line);
-			}
-			else if(strcasecmp("QUIT", command) == 0)
-			{
-				reply(221, "%s Service closing transmission channel", "MY DOMAIN HERE!!!");
-				done = true;
-			}
-			else if(strcasecmp("RSET", command) == 0)
-			{
-				rset(pcmd_line);
-			}
-			else if(strcasecmp("NOOP", command) == 0)
-			{
-				reply(250);
-			}
-			else if(strcasecmp("VRFY", command) == 0)
+			if(m_sock.sendSpace() < SERVER_MIN_SEND_SPACE && !m_sock.flushSome())
+				return RS_WANT_WRITE;
+
+			if(m_state == SS_DATA || m_state == SS_CHUNK)
 			{
-				vrfy(command);
+				if(m_state == SS_DATA ? text() : chunk())
+					continue;
+
+				if(reads < SERVER_MAX_READS && m_sock.receive())
+				{
+					++reads;
+					continue;
+				}
+
+				break;
 			}
-			else
+
+			char line[SMTP_MAX_COMMAND_LENGTH];
+			Socket::LINE_STATUS status = m_sock.nextLine(line, sizeof line, NULL);
+
+			if(status == Socket::LINE_PENDING)
 			{
-				reply(500, "Command unknown: '%s'", command);
+				if(reads < SERVER_MAX_READS && m_sock.receive())
+				{
+					++reads;
+					continue;
+				}
+
+				break;
 			}
 
+			if(status == Socket::LINE_TOO_LONG)
+				reply(500, "Line too long");
+			else
+				command(line);
 		}
+
+		if(!m_sock.flushSome())
+			return RS_WANT_WRITE;
+
+		if(m_state == SS_QUIT)
+			return RS_DONE;
+
+		m_sock.releaseBuffers();
+		return RS_WANT_READ;
 	}
 	catch(SocketError & e)
 	{
-		m_log.log(LOG_WARN, "Server::run(): SMTP server error: %s", e.errMsg());
-		return 1;
+		m_log.log(LOG_WARN, "Server::resume(): SMTP server error: %s", e.errMsg());
+		return RS_DONE;
 	}
+}
 
-	return 0;
+void Server::command(char* command_line)
+{
+	char *args = command_line;
+
+	switch(command_key(&args))
+	{
+	case COMMAND_KEY('H', 'E', 'L', 'O'):
+		helo(args);
+		break;
+
+	case COMMAND_KEY('E', 'H', 'L', 'O'):
+		ehlo(args);
+		break;
+
+	case COMMAND_KEY('M', 'A', 'I', 'L'):
+		mail(args);
+		break;
+
+	case COMMAND_KEY('R', 'C', 'P', 'T'):
+		rcpt(args);
+		break;
+
+	case COMMAND_KEY('D', 'A', 'T', 'A'):
+		data(args);
+		break;
+
+	case COMMAND_KEY('B', 'D', 'A', 'T'):
+		bdat(args);
+		break;
+
+	case COMMAND_KEY('Q', 'U', 'I', 'T'):
+		reply(221, "%s Service closing transmission channel", "MY DOMAIN HERE!!!");
+		m_state = SS_QUIT;
+		break;
+
+	case COMMAND_KEY('R', 'S', 'E', 'T'):
+		rset(args);
+		break;
+
+	case COMMAND_KEY('N', 'O', 'O', 'P'):
+		reply(250);
+		break;
+
+	case COMMAND_KEY('V', 'R', 'F', 'Y'):
+		vrfy(args);
+		break;
+
+	default:
+		if(args == command_line)
+			reply(500);
+		else
+			reply(500, "Command unknown: '%.*s'", (int)(args - command_line), command_line);
+		break;
+	}
 }
 
 void Server::helo(char* /*command*/)
 {
+	m_spool.abort();
+	m_message.reset();
 	reply(250, "Either my machine or my domain");
 }
 
 void Server::ehlo(char* /*command*/)
 {
-	reply(250, "Either my machine or my domain.");
+	m_spool.abort();
+	m_message.reset();
+
+	// The first line is the greeting and each line after it names an extension.
+	// resume already handles every command the client has sent before
+	// flushing the replies together, which is all PIPELINING asks of us.
+	replyMore(250, "Either my machine or my domain.");
+	replyMore(250, "PIPELINING");
+	replyMore(250, "CHUNKING");
+	reply(250, "SIZE %lu", m_options.maxMessageSize());
 }
 
 void Server::mail(char* command)
 {
+	// Not in the middle of a BDAT transaction.
+	if(m_spool.isOpen())
+	{
+		reply(503);
+		return;
+	}
+
 	if(!matchtoken(&command, "from"))
 	{
 		reply(501);
@@ -292,9 +366,10 @@ void Server::mail(char* command)
 		return;
 	}
 
+	char path[SMTP_MAX_TEXT_LINE + 1];
 	char *local_part, *domain_part;
 
-	if(!mailpath(&command, &local_part, &domain_part))
+	if(!mailpath(&command, path, &local_part, &domain_part))
 	{
 		reply(553);
 		return;
@@ -302,22 +377,58 @@ void Server::mail(char* command)
 
 	if(!matchtoken(&command, ">"))
 	{
-		delete[] local_part;
-		delete[] domain_part;
 		reply(501);
 		return;
 	}
-	
-	m_message.from.setPath(local_part, domain_part);
 
-	delete[] local_part;
-	delete[] domain_part;
+	// The ESMTP parameters. SIZE is the only one we know.
+	unsigned long size = 0;
+	char param[SMTP_MAX_COMMAND_LENGTH];
+	short error = 0;
+
+	while(!error && nexttoken(&command, param, sizeof param))
+	{
+		char *end;
+
+		if(strncasecmp(param, "SIZE=", 5) != 0)
+			error = 555;
+		else if(!isdigit((unsigned char)param[5]) || (size = strtoul(param + 5, &end, 10), *end))
+			error = 501;
+	}
+
+	if(!error && tooBig(size))
+		error = 552;
+
+	// Make sure the message will fit in the spool directory.
+	unsigned long free_kb;
+	if(!error && size > 0 && free_disk_space_kb(m_options.sendDir(), &free_kb) && size / 1024 >= free_kb)
+	{
+		m_log.log(LOG_SERVER, "Server::mail(): Not enough room in the send directory for a %lu byte message.", size);
+		error = 452;
+	}
+
+	if(error)
+	{
+		reply(error);
+		return;
+	}
+
+	// A second MAIL FROM replaces the sender. Its copy stays in the arena
+	// until the end of the transaction, which is harmless.
+	m_message.from.setPath(m_message.arena, local_part, domain_part);
+	m_message.size = size;
 
 	reply(250);
 }
 
 void Server::rcpt(char* command)
 {
+	if(m_spool.isOpen())
+	{
+		reply(503);
+		return;
+	}
+
 	if(!matchtoken(&command, "to"))
 	{
 		reply(501);
@@ -336,8 +447,9 @@ void Server::rcpt(char* command)
 		return;
 	}
 
+	char path[SMTP_MAX_TEXT_LINE + 1];
 	char *local_part, *domain_part;
-	if(!mailpath(&command, &local_part, &domain_part))
+	if(!mailpath(&command, path, &local_part, &domain_part))
 	{
 		reply(553);
 		return;
@@ -345,8 +457,6 @@ void Server::rcpt(char* command)
 
 	if(!matchtoken(&command, ">"))
 	{
-		delete[] local_part;
-		delete[] domain_part;
 		reply(501);
 		return;
 	}
@@ -358,150 +468,310 @@ void Server::rcpt(char* command)
 		break;
 
 	case MS_MAILBOX_NOT_FOUND:
-		delete[] local_part;
-		delete[] domain_part;
 		reply(550);
 		return;
 	}
 
 	m_message.add_recipient(local_part, domain_part);
 
-	delete[] local_part;
-	delete[] domain_part;
-
 	reply(250);
 }
 
 void Server::data(char* /*command*/)
 {
-	if(!m_message.from.isSet())
+	if(!m_message.from.isSet() || m_spool.isOpen())
 	{
 		reply(503);
 		return;
 	}
 
-	if(!m_message.to->isSet())
+	if(!m_message.to)
 	{
 		reply(554, "No valid recipients");
 		return;
 	}
 
+	if(!openSpool())
+	{
+		reply(452);
+		return;
+	}
+
+	m_data_error = 0;
+	m_state = SS_DATA;
 	reply(354);
+}
 
-	// Name this file NEWxxx so that the sender thread doesn't pick it
-	// up until we have completely written it. When we have completed,
-	// we will rename it to MSGxxx.
-	char NEW_PREFIX[] = { DIR_DELIM, 'N', 'E', 'W', '\0' };
-	size_t new_filename_len = 0;
-	char *filename = 0;
-	char *new_filename = 0;
-	FILE *fp = newfile(m_options.sendDir(), "NEW", &filename);
+void Server::bdat(char* command)
+{
+	char size[SMTP_MAX_COMMAND_LENGTH];
+	char *end;
 
-	if(!fp)
+	if(!nexttoken(&command, size, sizeof size) || !isdigit((unsigned char)size[0]))
 	{
-		reply(452);
+		reply(501);
 		return;
 	}
 
-	int rc = fprintf(fp, "MAILSERV SENDER FILE%s", CRLF);
-	if(rc >= 0)
-		rc = fprintf(fp, "%s%s", m_message.from.getLocal(), CRLF);
-	if(rc >= 0)
-		rc = fprintf(fp, "%s%s", m_message.from.getDomain(), CRLF);
-	if(rc >= 0)
+	m_chunk_size = strtoul(size, &end, 10);
+	if(*end)
 	{
-		for(ToList *p = m_message.to; p && rc >= 0; p = p->next)
+		reply(501);
+		return;
+	}
+
+	m_chunk_last = false;
+	if(nexttoken(&command, size, sizeof size))
+	{
+		if(strcasecmp(size, "LAST") != 0)
 		{
-			rc = fprintf(fp, "%s%s", p->recipient.getLocal(), CRLF);
-			if(rc >= 0)
-				rc = fprintf(fp, "%s%s", p->recipient.getDomain(), CRLF);
+			reply(501);
+			return;
 		}
+		m_chunk_last = true;
 	}
 
-	if(rc >= 0)
-		rc = fprintf(fp, "<END>%s", CRLF);
+	// The chunk follows the command straight away, so even if it's going to be
+	// refused it has to be read, or it would be taken for commands.
+	m_chunk_remaining = m_chunk_size;
+	m_state = SS_CHUNK;
 
-	if(rc < 0)
+	if(!m_message.from.isSet())
+		m_data_error = 503;
+	else if(!m_message.to)
+		m_data_error = 554;
+	else if(!m_spool.isOpen() && !openSpool())
+		m_data_error = 452;
+	else if(tooBig(m_data_size + m_chunk_size))
+		m_data_error = 552;
+	else
 	{
-		m_log.log(LOG_SERVER, "Server::data(): Error writing header to send file.");
-		reply(452);
-		goto cleanup;
+		m_data_size += m_chunk_size;
+		m_data_error = 0;
 	}
+}
 
-	try
+bool Server::tooBig(unsigned long size) const
+{
+	unsigned long max = m_options.maxMessageSize();
+	return max > 0 && size > max;
+}
+
+bool Server::openSpool()
+{
+	if(!m_spool.open())
+		return false;
+
+	bool rc = m_spool.writeSender(m_message.from.getLocal(), m_message.from.getDomain());
+
+	for(ToList *p = m_message.to; p && rc; p = p->next)
+		rc = m_spool.writeRecipient(p->recipient.getLocal(), p->recipient.getDomain());
+
+	if(rc)
+		rc = m_spool.endEnvelope();
+
+	if(!rc)
 	{
-		char buf[SMTP_MAX_TEXT_LINE];
-		bool got_line;
-		unsigned int len;
+		m_log.log(LOG_SERVER, "Server::openSpool(): Error writing header to send file.");
+		m_spool.abort();
+		return false;
+	}
 
-		while((got_line = m_sock.getLine(buf, sizeof buf, &len)) != false && strcmp(buf, ".") != 0)
-		{
-			if(fwrite(buf, 1, len, fp) != len ||
-				fwrite(CRLF, 1, 2, fp) != 2)
-			{
-				reply(452);
-				m_log.log(LOG_SERVER, "Server::data(): Error writing user data to send file.");
-				goto cleanup;
-			}
-		}
+	// Make room for the message the client said it is sending, and the
+	// terminating line.
+	if(m_message.size > 0)
+		m_spool.reserve(m_message.size + 3);
+
+	m_data_size = 0;
+	m_scanner.reset();
+
+	// The text starts at the beginning of a line.
+	m_chunk_tail[0] = CR;
+	m_chunk_tail[1] = LF;
+
+	return true;
+}
+
+bool Server::text()
+{
+	const char *data;
+	unsigned int len = m_sock.buffered(&data);
+	bool end;
+	unsigned int used = m_scanner.scan(data, len, &end);
+
+	appendText(data, used);
+	m_sock.consume(used);
+
+	if(!end)
+		return false;
+
+	// Skip the terminating line.
+	m_sock.consume(3);
+
+	// The whole text has been read, so now the message can be refused.
+	if(m_scanner.tooLong() && !m_data_error)
+	{
+		m_log.log(LOG_SERVER, "Server::text(): Line too long while receiving DATA from client.");
+		m_data_error = 500;
+	}
+
+	endData();
+	return true;
+}
+
+void Server::appendText(const char* data, unsigned int len)
+{
+	if(m_data_error)
+		return;
+
+	m_data_size += len;
+	if(tooBig(m_data_size))
+	{
+		m_data_error = 552;
+		return;
+	}
+
+	if(!m_spool.write(data, len))
+	{
+		m_log.log(LOG_SERVER, "Server::appendText(): Error writing user data to send file.");
+		m_data_error = 452;
+	}
+}
+
+bool Server::chunk()
+{
+	while(m_chunk_remaining > 0)
+	{
+		const char *data;
+		unsigned int len = m_sock.buffered(&data);
 
-		if(!got_line)
+		if(len == 0)
+			return false;
+
+		if(len > m_chunk_remaining)
+			len = m_chunk_remaining;
+
+		// After an error the rest of the chunk is thrown away.
+		if(!m_data_error && !appendChunk(data, len))
 		{
-			reply(500);
-			m_log.log(LOG_SERVER, "Server::data(): Error while receiving DATA from client.");
-			goto cleanup;
+			m_log.log(LOG_SERVER, "Server::chunk(): Error writing user data to send file.");
+			m_data_error = 452;
 		}
+
+		m_sock.consume(len);
+		m_chunk_remaining -= len;
 	}
-	catch(...)
+
+	endChunk();
+	return true;
+}
+
+bool Server::appendChunk(const char* data, unsigned int len)
+{
+	unsigned int used = 0;
+
+	while(used < len)
 	{
-		fclose(fp);
-		unlink(filename);
-		delete[] filename;
-		throw;
+		// Lines starting with a '.' get another one in front, as the client
+		// would have sent them with DATA.
+		if(m_chunk_tail[1] == LF && data[used] == '.' && !m_spool.write(".", 1))
+			return false;
+
+		// Copy up to and including the next LF.
+		const char *lf = (const char*)memchr(data + used, LF, len - used);
+		unsigned int n = lf ? (unsigned int)(lf - (data + used)) + 1 : len - used;
+
+		if(!m_spool.write(data + used, n))
+			return false;
+
+		used += n;
+
+		m_chunk_tail[0] = n >= 2 ? data[used - 2] : m_chunk_tail[1];
+		m_chunk_tail[1] = data[used - 1];
 	}
 
-	if(fprintf(fp, ".%s", CRLF) < 0)
+	return true;
+}
+
+void Server::endChunk()
+{
+	m_state = SS_COMMAND;
+
+	if(m_data_error)
 	{
-		m_log.log(LOG_SERVER, "Server::data(): Error writing '.' terminator to send file.");
-		reply(452);
-		goto cleanup;
+		// The whole transaction fails with the chunk.
+		m_spool.abort();
+		m_message.reset();
+		reply(m_data_error);
+		return;
+	}
+
+	if(!m_chunk_last)
+	{
+		reply(250, "%lu octets received", m_chunk_size);
+		return;
+	}
+
+	// The spool file ends with <CRLF>.<CRLF>, but BDAT text doesn't have to end
+	// with a CRLF.
+	if((m_chunk_tail[0] != CR || m_chunk_tail[1] != LF) && !m_spool.write(CRLF, 2))
+	{
+		m_log.log(LOG_SERVER, "Server::endChunk(): Error writing user data to send file.");
+		m_data_error = 452;
 	}
 
-	fclose(fp);
+	endData();
+}
+void Server::endData()
+{
+	m_state = SS_COMMAND;
+
+	// The transaction is over whether or not the message was accepted.
+	m_message.reset();
 
-	// Rename the file to have a MSG prefix instead of a NEW prefix. This indicates
-	// that the file is completely written out.
-	new_filename = strdupnew(filename);
-	new_filename_len = strlen(new_filename);
+	if(m_data_error)
+	{
+		m_spool.abort();
+		reply(m_data_error);
+		return;
+	}
 
-	while(new_filename_len--)
+	if(!m_spool.write(".\r\n", 3))
 	{
-		if(strncmp(NEW_PREFIX, new_filename + new_filename_len, 4) == 0)
-		{
-			memcpy(new_filename + new_filename_len, "/MSG", 4);
-			if(rename(filename, new_filename) != 0)
-			{
-				reply(452, "Error renaming file.");
-				goto cleanup;
-			}
-		}
+		m_log.log(LOG_SERVER, "Server::endData(): Error writing '.' terminator to send file.");
+		m_spool.abort();
+		reply(452);
+		return;
 	}
 
-	delete[] filename;
+	// Without syncing there is nothing to gain from the SpoolCommitter.
+	if(m_options.spoolSync() == SPOOL_SYNC_NONE)
+	{
+		// commit logs what went wrong.
+		reply(m_spool.commit() ? 250 : 452);
+		return;
+	}
 
-	reply(250);
-	return;
+	if(!m_spool.end())
+	{
+		m_log.log(LOG_SERVER, "Server::endData(): Error writing user data to send file.");
+		m_spool.abort();
+		reply(452);
+		return;
+	}
 
-cleanup:
-	if(fp)
-		fclose(fp);
-	if(filename)
-		unlink(filename);
-	delete[] filename;
+	// resume returns RS_WANT_COMMIT, and replies once the commit is done.
+	m_state = SS_COMMIT;
+}
+
+void Server::commitSpool(SpoolCommitter & committer, void (*done)(void*), void* data)
+{
+	committer.add(&m_spool, done, data);
 }
 
 void Server::rset(char* /*command*/)
 {
+	m_spool.abort();
 	m_message.reset();
 	reply(250);
 }
@@ -511,6 +781,23 @@ void Server::vrfy(char* /*command*/)
 	reply(502);
 }
 
+void Server::replyMore(short code, const char* format, ...)
+{
+	assert(code >= 0 && code < 1000);
+	char buf[SMTP_MAX_REPLY_LENGTH];
+	int len = safe_snprintf(buf, sizeof buf, "%d-", code);
+
+	va_list va;
+	va_start(va, format);
+	safe_vsnprintf(buf + len, sizeof(buf) - len, format, va);
+	va_end(va);
+
+	// Make sure buf is NULL terminated.
+	buf[sizeof(buf) - 1] = 0;
+
+	m_sock.putLine(buf);
+}
+
 void Server::reply(short code, const char* format, ...)
 {
 	// Send the reply code
@@ -606,6 +893,9 @@ void Server::reply(short code, const char* format, ...)
 		case 554:
 			msg = "Transaction failed";
 			break;
+		case 555:
+			msg = "MAIL FROM/RCPT TO parameters not recognized or not implemented";
+			break;
 		}
 
 		if(msg)
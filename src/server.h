@@ -34,7 +34,16 @@
 #include "socket.h"
 #include "accounts.h"
 #include "options.h"
-
+#include "data_scanner.h"
+#include "arena.h"
+#include "spool_writer.h"
+#include <stdio.h>
+
+// An SMTP session. The session doesn't have a thread of its own. Its socket is
+// non-blocking, and whoever owns the Server calls resume each time the socket
+// is ready. resume handles everything the client has sent so far and returns to
+// say what it is waiting for, keeping its place in the conversation in the
+// Server object between calls.
 class Server
 {
 	Socket m_sock;
@@ -42,54 +51,113 @@ class Server
 	const Accounts & m_accounts;
 	const Options & m_options;
 
+	// Where the session is in the conversation with the client.
+	enum SESSION_STATE
+	{
+		SS_GREETING, // The 220 greeting hasn't been sent yet.
+		SS_COMMAND, // Waiting for a command.
+		SS_DATA, // Receiving the message text after DATA.
+		SS_CHUNK, // Receiving the bytes of a BDAT chunk.
+		SS_COMMIT, // Waiting for the SpoolCommitter before replying to the end of the message.
+		SS_QUIT // The client has said QUIT.
+	} m_state;
+
+	// The spool file the message text is written to. It stays open from DATA
+	// to the terminating '.', or from the first BDAT to the one marked LAST.
+	SpoolWriter m_spool;
+	short m_data_error; // The reply to give at the end of the text if something went wrong, or 0.
+	unsigned long m_data_size; // The number of bytes of message text received so far.
+	DataScanner m_scanner; // Finds the end of the text after DATA.
+
+	unsigned long m_chunk_size; // The size of the BDAT chunk being received.
+	unsigned long m_chunk_remaining; // The bytes of it still to come.
+	bool m_chunk_last; // True if it is the last chunk of the message.
+	char m_chunk_tail[2]; // The last two bytes of chunk data written to the spool file.
+
+	// Process one line from the client.
+	void command(char* command_line);
+
+	// Take as much of the text after DATA as has been received. Returns false
+	// if the end of it hasn't arrived yet.
+	bool text();
+
+	// Add len bytes of message text to the spool file.
+	void appendText(const char* data, unsigned int len);
+
+	// Take as much of the BDAT chunk as has been received. Returns false if
+	// the rest hasn't arrived yet.
+	bool chunk();
+
+	// Add len bytes of chunk data to the spool file, dot-stuffing it so the
+	// spool file holds the message in wire format, as it does for DATA.
+	// Returns false on error.
+	bool appendChunk(const char* data, unsigned int len);
+
+	// Reply to the client once all of a BDAT chunk has been received.
+	void endChunk();
+
+	// Create the spool file and write the envelope to it. Returns false on error.
+	bool openSpool();
+
+	// Returns true if a message of size bytes is more than max_message_size allows.
+	bool tooBig(unsigned long size) const;
+
+	// Finish up the spool file after the terminating '.' and reply to the client.
+	void endData();
+
 	// command processing functions
 	void helo(char* command);
 	void ehlo(char* command);
 	void mail(char* command);
 	void rcpt(char* command);
 	void data(char* command);
+	void bdat(char* command);
 	void rset(char* command);
 	void vrfy(char* command);
 
 	// commmand/reply functions
 	void reply(short code, const char* format = 0, ...); // Send a reply.
+	void replyMore(short code, const char* format, ...); // Send a line of a multi-line reply. End it with reply.
 
+	// A mailbox from the envelope. The strings belong to the Message's arena.
 	class Mailbox
 	{
-		char *local_part;
-		char *domain_part;
+		const char *local_part;
+		const char *domain_part;
 
 	public:
 		Mailbox();
-		~Mailbox();
 
 		const char* getLocal() const;
 		const char* getDomain() const;
 
-		void setPath(const char* newLocal, const char* newDomain);
+		void setPath(Arena & arena, const char* newLocal, const char* newDomain);
 
 		void clear();
 		bool isSet();
 	};
 
+	// The nodes are allocated from the Message's arena and never deleted.
 	struct ToList
 	{
 		ToList *next;
 		Mailbox recipient;
 
 		ToList();
-		~ToList();
 		bool isSet();
 	};
 
+	// The envelope of the message being received. Everything in it is
+	// allocated from arena, so reset frees it all in one go at the end of
+	// the transaction and the next one reuses the memory.
 	struct Message
 	{
+		Arena arena;
 		Mailbox from;
 		ToList *to;
-		char *data;
+		unsigned long size; // The size the client gave with MAIL FROM, or 0.
 
 		Message();
-		~Message();
 
 		void add_recipient(const char* localpart, const char* domainpart);
 		void reset();
@@ -99,10 +167,30 @@ class Server
 	const Server & operator=(const Server &);
 
 public:
-	Server(SOCKET sock, const Accounts & accounts, const Options & options);
+	// sock must be in non-blocking mode.
+	// The messages received are queued with sender.
+	Server(SOCKET sock, const Accounts & accounts, const Options & options, Sender & sender);
 	~Server();
 
-	int run();
+	enum RESUME_STATUS
+	{
+		RS_WANT_READ, // Call resume again when the socket is readable.
+		RS_WANT_WRITE, // Call resume again when the socket is writable.
+		RS_WANT_COMMIT, // Call commitSpool, and resume again when the commit is done.
+		RS_DONE // The session is over. Delete the Server.
+	};
+
+	// Carry on with the session as far as the socket allows without waiting.
+	RESUME_STATUS resume();
+
+	// Hand the message's spool file to committer after resume returned
+	// RS_WANT_COMMIT. The Server must not be touched again until committer
+	// calls done(data).
+	void commitSpool(SpoolCommitter & committer, void (*done)(void*), void* data);
+
+	// Give up the socket without closing it. Only for a session that hasn't
+	// been resumed yet.
+	void detach();
 };
 
 #endif
@@ -31,56 +31,186 @@
 #include "utility.h"
 #include <fcntl.h>
 
+#ifndef WIN32
+#include <netinet/tcp.h>
+#include <errno.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// Don't let a peer that has gone away kill the server with SIGPIPE. The send
+// just fails with an error, which is turned into a SocketError.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
 //
 // Socket
 //
 
 Socket::Socket(SOCKET newSock)
-: sock(newSock)
+: m_recv_buf(0),
+m_recv_start(0),
+m_recv_end(0),
+m_recv_scan(0),
+m_discarding(false),
+m_send_buf(0),
+m_send_len(0),
+sock(newSock)
 {
+	// Replies are collected in the send buffer and written out whole, so there
+	// is nothing for Nagle's algorithm to coalesce. It would only delay them.
+	if(sock != INVALID_SOCKET)
+	{
+		int on = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof on);
+	}
 }
 
 Socket::~Socket()
 {
 	if(sock != INVALID_SOCKET)
 		close();
+
+	delete[] m_recv_buf;
+	delete[] m_send_buf;
 }
 
-bool Socket::getLine(char* command_buf, const int BUFLEN, unsigned int* pLength)
+void Socket::fill()
+{
+	flush();
+	readSome();
+}
+
+bool Socket::readSome()
 {
-	int i;
+	if(!m_recv_buf)
+		m_recv_buf = new char[SOCKET_RECV_BUFLEN];
+
+	if(m_recv_start == m_recv_end)
+	{
+		// Everything has been consumed, so start over at the front of the buffer.
+		m_recv_start = m_recv_end = m_recv_scan = 0;
+	}
+	else if(m_recv_end == SOCKET_RECV_BUFLEN && m_recv_start > 0)
+	{
+		// Move the unread data to the front to make room for more.
+		memmove(m_recv_buf, m_recv_buf + m_recv_start, m_recv_end - m_recv_start);
+		m_recv_end -= m_recv_start;
+		m_recv_scan -= m_recv_start;
+		m_recv_start = 0;
+	}
+
+	int bytesReceived = ::recv(sock, m_recv_buf + m_recv_end, SOCKET_RECV_BUFLEN - m_recv_end, 0);
+	if(bytesReceived == SOCKET_ERROR)
+	{
+		if(socket_would_block())
+			return false;
+		throw SocketError("Error receiving data");
+	}
+	if(bytesReceived == 0)
+		throw SocketError("The connection has been closed.");
+
+	m_recv_end += bytesReceived;
+	return true;
+}
 
-	for(i = 0; i < BUFLEN; ++i)
+int Socket::findCRLF()
+{
+	while(m_recv_scan < m_recv_end)
 	{
-		recv(command_buf + i, 1);
-		if(i > 0 && command_buf[i - 1] == CR && command_buf[i] == LF)
+		char *lf = (char*)memchr(m_recv_buf + m_recv_scan, LF, m_recv_end - m_recv_scan);
+
+		if(!lf)
 		{
-			// Remove the CRLF.
-			command_buf[i - 1] = 0;
+			m_recv_scan = m_recv_end;
 			break;
 		}
+
+		m_recv_scan = (int)(lf - m_recv_buf) + 1;
+
+		// Only count the CR if it belongs to the line being read.
+		if(lf > m_recv_buf + m_recv_start && lf[-1] == CR)
+			return m_recv_scan;
 	}
 
-	// If we read MAXLEN characters but never got a CRLF then
-	// eat all the characters until we get a CRLF.
-	if(i == BUFLEN)
+	return -1;
+}
+
+bool Socket::getLine(char* command_buf, const int BUFLEN, unsigned int* pLength)
+{
+	LINE_STATUS status;
+
+	while((status = nextLine(command_buf, BUFLEN, pLength)) == LINE_PENDING)
+		fill();
+
+	return status == LINE_OK;
+}
+
+Socket::LINE_STATUS Socket::nextLine(char* command_buf, const int BUFLEN, unsigned int* pLength)
+{
+	// A line can't be longer than the receive buffer, no matter how big BUFLEN is.
+	const int maxlen = BUFLEN < SOCKET_RECV_BUFLEN ? BUFLEN : SOCKET_RECV_BUFLEN;
+	int line_end = findCRLF();
+
+	if(line_end == -1)
 	{
-		char cur = command_buf[BUFLEN - 1];
-		char last = 0;
-		
-		while(last != CR || cur != LF)
+		// If we got maxlen characters but never got a CRLF then throw away
+		// everything until we get a CRLF. The last character is kept in case it
+		// is the CR.
+		if(m_recv_end - m_recv_start >= maxlen)
 		{
-			last = cur;
-			recv(&cur, 1);
+			m_discarding = true;
+			m_recv_start = m_recv_end - 1;
 		}
 
-		command_buf[BUFLEN - 1] = 0;
+		return LINE_PENDING;
+	}
+
+	// The line length doesn't include the CRLF.
+	int len = line_end - m_recv_start - 2;
+	LINE_STATUS status = LINE_OK;
+
+	if(m_discarding || len > maxlen - 2)
+	{
+		m_discarding = false;
+		status = LINE_TOO_LONG;
+		command_buf[0] = 0;
 	}
+	else
+	{
+		memcpy(command_buf, m_recv_buf + m_recv_start, len);
+		command_buf[len] = 0;
+
+		if(pLength)
+			*pLength = (unsigned int)len;
+	}
+
+	m_recv_start = line_end;
+
+	return status;
+}
 
-	if(i < BUFLEN && i > 0 && pLength)
-		*pLength = (unsigned int)i - 1;
+bool Socket::receive()
+{
+	return readSome();
+}
 
-	return i < BUFLEN;
+int Socket::buffered(const char** pdata) const
+{
+	*pdata = m_recv_buf + m_recv_start;
+	return m_recv_end - m_recv_start;
+}
+
+void Socket::consume(int len)
+{
+	m_recv_start += len;
+	if(m_recv_scan < m_recv_start)
+		m_recv_scan = m_recv_start;
 }
 
 void Socket::putLine(const char* command)
@@ -90,27 +220,203 @@ void Socket::putLine(const char* command)
 }
 
 void Socket::send(const void* buf, int len, int flags)
+{
+	if(flags != 0)
+	{
+		// The flags apply to this data only, so it can't be buffered with the rest.
+		flush();
+		sendAll((const char*)buf, len, flags);
+		return;
+	}
+
+	if(m_send_len + len <= SOCKET_SEND_BUFLEN)
+	{
+		if(!m_send_buf)
+			m_send_buf = new char[SOCKET_SEND_BUFLEN];
+
+		memcpy(m_send_buf + m_send_len, buf, len);
+		m_send_len += len;
+	}
+	else
+		sendGather((const char*)buf, len);
+}
+
+void Socket::flush()
+{
+	if(m_send_len > 0)
+	{
+		// Empty the buffer first so a failed send doesn't leave the data behind
+		// to be sent again by close.
+		int len = m_send_len;
+		m_send_len = 0;
+		sendAll(m_send_buf, len, 0);
+	}
+}
+
+bool Socket::flushSome()
+{
+	int totalSent = 0;
+
+	while(totalSent < m_send_len)
+	{
+		int bytesSent = ::send(sock, m_send_buf + totalSent, m_send_len - totalSent, SEND_FLAGS);
+		if(bytesSent == SOCKET_ERROR)
+		{
+			if(socket_would_block())
+				break;
+
+			m_send_len = 0;
+			throw SocketError("Error sending data");
+		}
+		totalSent += bytesSent;
+	}
+
+	// Keep whatever didn't go for next time.
+	m_send_len -= totalSent;
+	if(totalSent > 0 && m_send_len > 0)
+		memmove(m_send_buf, m_send_buf + totalSent, m_send_len);
+
+	return m_send_len == 0;
+}
+
+void Socket::releaseBuffers()
+{
+	if(m_recv_start == m_recv_end && !m_discarding)
+	{
+		delete[] m_recv_buf;
+		m_recv_buf = 0;
+		m_recv_start = m_recv_end = m_recv_scan = 0;
+	}
+
+	if(m_send_len == 0)
+	{
+		delete[] m_send_buf;
+		m_send_buf = 0;
+	}
+}
+
+void Socket::sendAll(const char* buf, int len, int flags)
 {
 	int bytesSent = 0;
 	int totalSent = 0;
 
 	while(totalSent < len)
 	{
-		bytesSent = ::send(sock, (const char*)buf, len, flags);
+		bytesSent = ::send(sock, buf + totalSent, len - totalSent, flags | SEND_FLAGS);
 		if(bytesSent == SOCKET_ERROR)
 			throw SocketError("Error sending data");
 		totalSent += bytesSent;
 	}
 }
 
+void Socket::sendGather(const char* buf, int len)
+{
+#ifdef WIN32
+	flush();
+	sendAll(buf, len, 0);
+#else
+	struct iovec iov[2];
+	struct iovec *piov = iov;
+	int iovcnt = 0;
+
+	if(m_send_len > 0)
+	{
+		iov[iovcnt].iov_base = m_send_buf;
+		iov[iovcnt].iov_len = m_send_len;
+		++iovcnt;
+	}
+
+	iov[iovcnt].iov_base = (void*)buf;
+	iov[iovcnt].iov_len = len;
+	++iovcnt;
+
+	m_send_len = 0;
+
+	while(iovcnt > 0)
+	{
+		struct msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = piov;
+		msg.msg_iovlen = iovcnt;
+
+		ssize_t bytesSent = ::sendmsg(sock, &msg, SEND_FLAGS);
+		if(bytesSent == SOCKET_ERROR)
+			throw SocketError("Error sending data");
+
+		// Skip past whatever was sent. It may have stopped part way through a vector.
+		while(iovcnt > 0 && (size_t)bytesSent >= piov->iov_len)
+		{
+			bytesSent -= piov->iov_len;
+			++piov;
+			--iovcnt;
+		}
+
+		if(iovcnt > 0)
+		{
+			piov->iov_base = (char*)piov->iov_base + bytesSent;
+			piov->iov_len -= bytesSent;
+		}
+	}
+#endif
+}
+
+long Socket::sendFile(int fd, long offset, long count)
+{
+#ifdef __linux__
+	off_t off = offset;
+	long totalSent = 0;
+
+	flush();
+
+	while(totalSent < count)
+	{
+		ssize_t bytesSent = ::sendfile(sock, fd, &off, count - totalSent);
+
+		if(bytesSent == SOCKET_ERROR)
+		{
+			// These mean sendfile can't be used with this file.
+			if(totalSent == 0 && (errno == EINVAL || errno == ENOSYS))
+				return -1;
+
+			throw SocketError("Error sending file");
+		}
+
+		// The file is shorter than we were told.
+		if(bytesSent == 0)
+			break;
+
+		totalSent += bytesSent;
+	}
+
+	return totalSent;
+#else
+	return -1;
+#endif
+}
+
 void Socket::recv(char* buf, int len, int flags)
 {
 	int bytesReceived = 0;
 	int totalReceived = 0;
 
+	flush();
+
+	// Hand out anything getLine has already buffered first.
+	if(m_recv_start < m_recv_end)
+	{
+		totalReceived = m_recv_end - m_recv_start;
+		if(totalReceived > len)
+			totalReceived = len;
+
+		memcpy(buf, m_recv_buf + m_recv_start, totalReceived);
+		m_recv_start += totalReceived;
+		if(m_recv_scan < m_recv_start)
+			m_recv_scan = m_recv_start;
+	}
+
 	while(totalReceived < len)
 	{
-		bytesReceived = ::recv(sock, buf, len, flags);
+		bytesReceived = ::recv(sock, buf + totalReceived, len - totalReceived, flags);
 		if(bytesReceived == SOCKET_ERROR)
 			throw SocketError("Error receiving data");
 		if(bytesReceived == 0)
@@ -121,6 +427,16 @@ void Socket::recv(char* buf, int len, int flags)
 
 void Socket::close()
 {
+	// Send whatever is left in the send buffer. If the other side has
+	// already gone away there is nobody to report the error to.
+	try
+	{
+		flush();
+	}
+	catch(SocketError &)
+	{
+	}
+
 	// Shutdown the transmission of data. Close is supposed to verify
 	// the data is sent to the client, but I can't get it to work without
 	// calling shutdown. I looked for information on the UNIX socket FAQ
@@ -129,3 +445,31 @@ void Socket::close()
 	::closesocket(sock);
 	sock = INVALID_SOCKET;
 }
+
+bool set_nonblocking(SOCKET s, bool nonblocking)
+{
+#ifdef WIN32
+	u_long mode = nonblocking ? 1 : 0;
+	return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	if(flags == -1)
+		return false;
+
+	if(nonblocking)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	return fcntl(s, F_SETFL, flags) == 0;
+#endif
+}
+
+bool socket_would_block()
+{
+#ifdef WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
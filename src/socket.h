@@ -53,6 +53,15 @@ typedef int SOCKET;
 
 #include "exceptions.h"
 
+// The size of the buffer each Socket receives into. Data is read from the
+// network in chunks of up to this many bytes and handed out a line at a time by
+// getLine, so it also limits the longest line getLine can return.
+#define SOCKET_RECV_BUFLEN 16384
+
+// The size of the buffer each Socket collects outgoing data in. Small writes are
+// gathered here and sent together when the buffer is flushed.
+#define SOCKET_SEND_BUFLEN 16384
+
 class SocketError : public RuntimeException
 {
 public:
@@ -61,6 +70,37 @@ public:
 
 class Socket
 {
+	char *m_recv_buf; // Received data that hasn't been handed out yet. Allocated on first use.
+	int m_recv_start; // Offset of the first unread byte in m_recv_buf.
+	int m_recv_end; // Offset just past the last received byte in m_recv_buf.
+	int m_recv_scan; // Offset getLine has already searched up to for a CRLF.
+	bool m_discarding; // True while the rest of an overlong line is being thrown away.
+	char *m_send_buf; // Data waiting to be sent. Allocated on first use.
+	int m_send_len; // The number of bytes in m_send_buf.
+
+	// Read as much as is available from the network into the receive buffer.
+	// Anything waiting in the send buffer is flushed first, since the other side
+	// is probably waiting for it before it sends us more.
+	void fill();
+
+	// Read as much as is available into the receive buffer with a single recv.
+	// Returns false if the socket is non-blocking and nothing was available.
+	bool readSome();
+
+	// Send len bytes straight to the network.
+	void sendAll(const char* buf, int len, int flags);
+
+	// Send the contents of the send buffer followed by buf in a single gather write.
+	void sendGather(const char* buf, int len);
+
+	// Returns the offset just past the next CRLF in the receive buffer, or -1 if
+	// the buffered data doesn't contain one.
+	int findCRLF();
+
+	// Sockets are not copyable. These have no definition.
+	Socket(const Socket &);
+	const Socket & operator=(const Socket &);
+
 public:
 	SOCKET sock;
 	Socket(SOCKET newSock);
@@ -68,11 +108,66 @@ public:
 
 	// These functions throw SocketError if the socket is closed while trying to read
 	// or write or if some other fatal error occurs.
+	//
+	// putLine and send (without flags) only queue the data in the send buffer. It is
+	// written out when the buffer fills up, when flush is called, before getLine or
+	// recv wait for data, and when the socket is closed.
 	bool getLine(char* command_buf, const int BUFLEN, unsigned int *pLength);
 	void putLine(const char* command);
 	void send(const void* buf, int len, int flags = 0);
 	void recv(char *buf, int len, int flags = 0);
+	void flush();
+
+	// The non-blocking interface, for sockets put in non-blocking mode and
+	// driven by a Reactor. These never wait. They throw SocketError under the
+	// same conditions as the functions above.
+	enum LINE_STATUS
+	{
+		LINE_OK, // A line was returned.
+		LINE_TOO_LONG, // A line longer than BUFLEN was received and thrown away.
+		LINE_PENDING // No complete line has been received yet.
+	};
+
+	// Get the next line from the receive buffer. Call receive when it returns
+	// LINE_PENDING to read more from the network.
+	LINE_STATUS nextLine(char* command_buf, const int BUFLEN, unsigned int *pLength);
+
+	// Read whatever has arrived into the receive buffer. Returns false if there
+	// was nothing to read.
+	bool receive();
+
+	// Get the received data that hasn't been handed out yet without copying it.
+	// Returns its length, which is 0 if there is none. Call consume to say how
+	// much of it was used.
+	int buffered(const char** pdata) const;
+	void consume(int len);
+
+	// Send as much of the send buffer as the network will take right now.
+	// Returns true if the send buffer is empty.
+	bool flushSome();
+
+	// The number of bytes that can be queued with send before it has to write
+	// to the network.
+	int sendSpace() const { return SOCKET_SEND_BUFLEN - m_send_len; }
+
+	// Free the buffers if they are empty. An idle connection then costs
+	// little more than the Socket object itself.
+	void releaseBuffers();
+
+	// Send count bytes of the open file fd, starting at offset, without copying
+	// them through user space. Anything in the send buffer goes first. Returns the
+	// number of bytes sent, which is less than count if the file ends early, or -1
+	// if the platform or file doesn't support it. Nothing has been sent when -1 is
+	// returned, so the caller can fall back to reading and sending the file itself.
+	long sendFile(int fd, long offset, long count);
 	void close();
 };
 
+// Put a socket into non-blocking mode, or back into blocking mode. Returns false on error.
+bool set_nonblocking(SOCKET s, bool nonblocking);
+
+// Returns true if the last socket call on a non-blocking socket failed only
+// because it would have had to wait.
+bool socket_would_block();
+
 #endif
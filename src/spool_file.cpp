@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "spool_file.h"
+#include <string.h>
+
+static void put16(unsigned char* p, unsigned int v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+}
+
+static void put32(unsigned char* p, unsigned long v)
+{
+	for(int i = 0; i < 4; ++i, v >>= 8)
+		p[i] = (unsigned char)v;
+}
+
+// An unsigned long may only have 32 bits, so shift a byte at a time.
+static void put64(unsigned char* p, unsigned long v)
+{
+	for(int i = 0; i < 8; ++i, v >>= 8)
+		p[i] = (unsigned char)v;
+}
+
+static unsigned int get16(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long get32(const unsigned char* p)
+{
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+		((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+// Returns false if the value doesn't fit in an unsigned long.
+static bool get64(const unsigned char* p, unsigned long* pv)
+{
+	unsigned long v = 0;
+	for(int i = 7; i >= 0; --i)
+	{
+		if(i >= (int)sizeof(unsigned long) && p[i] != 0)
+			return false;
+		if(i < (int)sizeof(unsigned long))
+			v = (v << 8) | p[i];
+	}
+
+	*pv = v;
+	return true;
+}
+
+void spool_header_encode(const SpoolHeader & header, unsigned char buf[SPOOL_HEADER_SIZE])
+{
+	memcpy(buf, SPOOL_MAGIC, SPOOL_MAGIC_SIZE);
+	put16(buf + 8, header.version);
+	put16(buf + 10, header.flags);
+	put32(buf + 12, header.envelopeLength);
+	put32(buf + 16, header.recipientCount);
+	put32(buf + 20, 0);
+	put64(buf + 24, header.bodyOffset);
+	put64(buf + 32, header.bodyLength);
+}
+
+bool spool_header_decode(const unsigned char buf[SPOOL_HEADER_SIZE], SpoolHeader & header)
+{
+	if(memcmp(buf, SPOOL_MAGIC, SPOOL_MAGIC_SIZE) != 0)
+		return false;
+
+	header.version = get16(buf + 8);
+	header.flags = get16(buf + 10);
+	header.envelopeLength = get32(buf + 12);
+	header.recipientCount = (unsigned int)get32(buf + 16);
+
+	return get64(buf + 24, &header.bodyOffset) && get64(buf + 32, &header.bodyLength);
+}
+
+void spool_retry_encode(const SpoolRetry & retry, unsigned char buf[SPOOL_RETRY_SIZE])
+{
+	put32(buf, retry.attempts);
+	put64(buf + 4, (unsigned long)retry.first);
+	put64(buf + 12, (unsigned long)retry.next);
+}
+
+void spool_retry_decode(const unsigned char buf[SPOOL_RETRY_SIZE], SpoolRetry & retry)
+{
+	unsigned long first = 0, next = 0;
+
+	// Times too far off to fit are as good as 0.
+	get64(buf + 4, &first);
+	get64(buf + 12, &next);
+
+	retry.attempts = (unsigned int)get32(buf);
+	retry.first = (time_t)first;
+	retry.next = (time_t)next;
+}
+
+unsigned long spool_mailbox_size(const char* local, const char* domain)
+{
+	return 4 + strlen(local) + strlen(domain);
+}
+
+unsigned long spool_mailbox_encode(unsigned char* buf, const char* local, const char* domain)
+{
+	unsigned char *p = buf;
+	const char *parts[2] = { local, domain };
+
+	for(int i = 0; i < 2; ++i)
+	{
+		size_t len = strlen(parts[i]);
+		put16(p, (unsigned int)len);
+		memcpy(p + 2, parts[i], len);
+		p += 2 + len;
+	}
+
+	return (unsigned long)(p - buf);
+}
+
+bool spool_string_decode(const unsigned char** pp, const unsigned char* end, char* buf, unsigned int size)
+{
+	const unsigned char *p = *pp;
+
+	if(end - p < 2)
+		return false;
+
+	unsigned int len = get16(p);
+	p += 2;
+
+	if((unsigned long)(end - p) < len || len >= size)
+		return false;
+
+	memcpy(buf, p, len);
+	buf[len] = 0;
+	*pp = p + len;
+	return true;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+// spool_file.h - the layout of the files in the send directory.
+
+#ifndef MAILSERV_SPOOL_FILE_H
+#define MAILSERV_SPOOL_FILE_H
+
+#include <time.h>
+
+// A spool file starts with a fixed size header, followed by the envelope and
+// then the message text. All numbers are little-endian.
+//
+//	offset	size	field
+//	0	8	SPOOL_MAGIC
+//	8	2	version (SPOOL_VERSION)
+//	10	2	flags (SPOOL_FLAG_*)
+//	12	4	envelope length
+//	16	4	recipient count
+//	20	4	reserved, 0
+//	24	8	body offset
+//	32	8	body length
+//
+// The envelope is the sender's mailbox followed by the recipients', after a
+// retry record if SPOOL_FLAG_RETRY is set. Each
+// mailbox is a 2 byte length and the local part, then a 2 byte length and
+// the domain, without NULL terminators. The body is the message text in wire
+// format (lines starting with a '.' have another one in front) including the
+// terminating <CRLF>.<CRLF>, and runs to the end of the file.
+//
+// A retry record holds the number of delivery attempts made so far (4
+// bytes), the time of the first (8 bytes) and the time of the next (8 bytes),
+// in seconds since 1970.
+//
+// Older versions wrote a text file instead: "MAILSERV SENDER FILE", then the
+// local part and domain of each mailbox on lines of their own, "<END>", and
+// the body. The sender still reads them.
+#define SPOOL_MAGIC "\x89SPL\r\n\x1a\n"
+#define SPOOL_MAGIC_SIZE 8
+#define SPOOL_VERSION 1
+#define SPOOL_HEADER_SIZE 40
+#define SPOOL_RETRY_SIZE 20
+
+// The message couldn't be sent to some of the recipients and is waiting to
+// be tried again. Files with it set are named RTYxxx instead of MSGxxx.
+#define SPOOL_FLAG_RETRY 0x0001
+#define SPOOL_FLAGS_KNOWN SPOOL_FLAG_RETRY
+
+// The longest local part or domain that fits in a mailbox's length field.
+#define SPOOL_MAX_STRING 0xFFFF
+
+struct SpoolHeader
+{
+	unsigned int version;
+	unsigned int flags;
+	unsigned long envelopeLength;
+	unsigned int recipientCount;
+	unsigned long bodyOffset;
+	unsigned long bodyLength;
+};
+
+struct SpoolRetry
+{
+	unsigned int attempts;
+	time_t first;
+	time_t next;
+};
+
+// Fill in buf from header.
+void spool_header_encode(const SpoolHeader & header, unsigned char buf[SPOOL_HEADER_SIZE]);
+
+// Fill in header from buf. Returns false if buf doesn't start with
+// SPOOL_MAGIC or a number doesn't fit in header.
+bool spool_header_decode(const unsigned char buf[SPOOL_HEADER_SIZE], SpoolHeader & header);
+
+void spool_retry_encode(const SpoolRetry & retry, unsigned char buf[SPOOL_RETRY_SIZE]);
+void spool_retry_decode(const unsigned char buf[SPOOL_RETRY_SIZE], SpoolRetry & retry);
+
+// Write a mailbox into buf, which must have room for spool_mailbox_size
+// bytes. Returns the number of bytes written.
+unsigned long spool_mailbox_encode(unsigned char* buf, const char* local, const char* domain);
+unsigned long spool_mailbox_size(const char* local, const char* domain);
+
+// Read the string at *pp, which mustn't go past end, into buf (which has room
+// for size bytes including the NULL terminator) and move *pp past it.
+// Returns false if the string is cut off or too long for buf.
+bool spool_string_decode(const unsigned char** pp, const unsigned char* end, char* buf, unsigned int size);
+
+#endif
@@ -0,0 +1,623 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "spool_writer.h"
+#include "utility.h"
+#include "io_ring.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#ifdef WIN32
+#include <io.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifndef WIN32
+// Sync a directory, so the names of the files in it are on disk.
+static bool sync_dir(const char* path)
+{
+	int fd = ::open(path, O_RDONLY);
+	if(fd == -1)
+		return false;
+
+	bool rc = fsync(fd) == 0;
+	::close(fd);
+	return rc;
+}
+#endif
+
+SpoolWriter::SpoolWriter(const Options & options, Sender* sender)
+: m_options(options),
+m_sender(sender),
+m_fp(0),
+m_filename(0),
+m_buf(0),
+m_len(0),
+m_offset(0),
+m_envelope_length(0),
+m_recipient_count(0),
+m_bSenderWritten(false),
+m_flags(0),
+m_retry_next(0),
+m_body_offset(0),
+m_reserved(0),
+m_committed(false)
+{
+}
+
+SpoolWriter::~SpoolWriter()
+{
+	abort();
+}
+
+bool SpoolWriter::open()
+{
+	if(m_fp)
+		return false;
+
+	m_fp = newfile(m_options.sendDir(), "NEW", &m_filename);
+	if(!m_fp)
+	{
+		m_log.log(LOG_SERVER, "SpoolWriter::open(): Could not create a file in the send directory.");
+		return false;
+	}
+
+#ifdef WIN32
+	m_buf = (char*)_aligned_malloc(SPOOL_BUFLEN, SPOOL_BUFALIGN);
+#else
+	void *p;
+	m_buf = posix_memalign(&p, SPOOL_BUFALIGN, SPOOL_BUFLEN) == 0 ? (char*)p : 0;
+#endif
+
+	if(!m_buf)
+	{
+		m_log.log(LOG_SERVER, "SpoolWriter::open(): Could not allocate the spool buffer.");
+		abort();
+		return false;
+	}
+
+	// The header is filled in by end, once the size of the body is known.
+	memset(m_buf, 0, SPOOL_HEADER_SIZE);
+	m_len = SPOOL_HEADER_SIZE;
+	m_offset = 0;
+	m_envelope_length = 0;
+	m_recipient_count = 0;
+	m_domain[0] = 0;
+	m_bSenderWritten = false;
+	m_flags = 0;
+	m_retry_next = 0;
+	m_body_offset = 0;
+	m_reserved = 0;
+	m_committed = false;
+	return true;
+}
+
+bool SpoolWriter::write(const char* data, unsigned int len)
+{
+	while(len > 0)
+	{
+		if(m_len == SPOOL_BUFLEN && !flush())
+			return false;
+
+		unsigned int n = SPOOL_BUFLEN - m_len;
+		if(n > len)
+			n = len;
+
+		memcpy(m_buf + m_len, data, n);
+		m_len += n;
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+bool SpoolWriter::writeMailbox(const char* local, const char* domain)
+{
+	if(m_body_offset != 0 || strlen(local) > SPOOL_MAX_STRING || strlen(domain) > SPOOL_MAX_STRING)
+		return false;
+
+	unsigned long size = spool_mailbox_size(local, domain);
+
+	// Mailboxes are short, so one always fits in an empty buffer.
+	if(m_len + size > SPOOL_BUFLEN && !flush())
+		return false;
+
+	if(m_len + size > SPOOL_BUFLEN)
+		return false;
+
+	m_len += spool_mailbox_encode((unsigned char*)m_buf + m_len, local, domain);
+	m_envelope_length += size;
+	return true;
+}
+
+bool SpoolWriter::writeRetry(const SpoolRetry & retry)
+{
+	if(m_envelope_length != 0 || !m_buf)
+		return false;
+
+	// Only the header has been written, so there's room.
+	spool_retry_encode(retry, (unsigned char*)m_buf + m_len);
+	m_len += SPOOL_RETRY_SIZE;
+	m_envelope_length += SPOOL_RETRY_SIZE;
+	m_flags |= SPOOL_FLAG_RETRY;
+	m_retry_next = retry.next;
+	return true;
+}
+
+bool SpoolWriter::writeSender(const char* local, const char* domain)
+{
+	if(m_bSenderWritten || !writeMailbox(local, domain))
+		return false;
+
+	m_bSenderWritten = true;
+	return true;
+}
+
+bool SpoolWriter::writeRecipient(const char* local, const char* domain)
+{
+	if(!m_bSenderWritten || !writeMailbox(local, domain))
+		return false;
+
+	if(m_recipient_count == 0)
+		safe_strcpy(m_domain, strlen(domain) < sizeof m_domain ? domain : "", sizeof m_domain);
+	++m_recipient_count;
+	return true;
+}
+
+bool SpoolWriter::endEnvelope()
+{
+	if(m_recipient_count == 0 || m_body_offset != 0)
+		return false;
+
+	m_body_offset = m_offset + m_len;
+	return true;
+}
+
+void SpoolWriter::reserve(unsigned long size)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+	// The file's size is left alone since the sender checks it against the header.
+	if(m_fp && size > 0 &&
+		fallocate(fileno(m_fp), FALLOC_FL_KEEP_SIZE, 0, m_offset + m_len + size) == 0)
+		m_reserved = m_offset + m_len + size;
+#endif
+}
+
+bool SpoolWriter::flush()
+{
+	unsigned int written = 0;
+
+#ifdef WIN32
+	written = fwrite(m_buf, 1, m_len, m_fp);
+	m_offset += written;
+	if(written != m_len)
+		return false;
+#else
+	int fd = fileno(m_fp);
+
+#ifdef HAVE_IO_URING
+	// Each worker thread has its own ring. The session may run on a different
+	// thread next time, so the write is finished before returning.
+	IoRing *ring = m_options.useIoUring() ? IoRing::threadRing() : 0;
+#endif
+
+	while(written < m_len)
+	{
+		int rc;
+#ifdef HAVE_IO_URING
+		if(ring)
+			rc = ring->write(fd, m_buf + written, m_len - written, m_offset);
+		else
+#endif
+			rc = pwrite(fd, m_buf + written, m_len - written, m_offset);
+
+		if(rc <= 0)
+			return false;
+
+		written += rc;
+		m_offset += rc;
+	}
+#endif
+
+	m_len = 0;
+	return true;
+}
+
+bool SpoolWriter::end()
+{
+	if(!m_fp || m_body_offset == 0)
+		return false;
+
+	SpoolHeader header;
+	header.version = SPOOL_VERSION;
+	header.flags = m_flags;
+	header.envelopeLength = m_envelope_length;
+	header.recipientCount = m_recipient_count;
+	header.bodyOffset = m_body_offset;
+	header.bodyLength = m_offset + m_len - m_body_offset;
+
+	unsigned char buf[SPOOL_HEADER_SIZE];
+	spool_header_encode(header, buf);
+
+	// Most messages are still all in the buffer, header included.
+	bool buffered = m_offset == 0;
+	if(buffered)
+		memcpy(m_buf, buf, SPOOL_HEADER_SIZE);
+
+	if(!flush())
+		return false;
+
+	if(!buffered)
+	{
+#ifdef WIN32
+		if(fseek(m_fp, 0, SEEK_SET) != 0 ||
+			fwrite(buf, 1, SPOOL_HEADER_SIZE, m_fp) != SPOOL_HEADER_SIZE ||
+			fseek(m_fp, 0, SEEK_END) != 0)
+			return false;
+#else
+		if(pwrite(fileno(m_fp), buf, SPOOL_HEADER_SIZE, 0) != SPOOL_HEADER_SIZE)
+			return false;
+#endif
+	}
+
+#ifndef WIN32
+	// The client can declare a bigger SIZE than it sends. Truncating to the
+	// length already written gives back the reserved blocks past the end of
+	// the file (punching a hole there does nothing on ext4).
+	if(m_reserved > m_offset && ftruncate(fileno(m_fp), m_offset) != 0)
+		m_log.log(LOG_WARN, "SpoolWriter::end(): Error freeing the space reserved for '%s'.", m_filename);
+#endif
+
+	return true;
+}
+
+bool SpoolWriter::sync()
+{
+	switch(m_options.spoolSync())
+	{
+	case SPOOL_SYNC_NONE:
+		break;
+
+#ifdef WIN32
+	case SPOOL_SYNC_DATA:
+	case SPOOL_SYNC_FULL:
+		return fflush(m_fp) == 0 && _commit(fileno(m_fp)) == 0;
+#else
+	case SPOOL_SYNC_DATA:
+		return fdatasync(fileno(m_fp)) == 0;
+
+	case SPOOL_SYNC_FULL:
+		return fsync(fileno(m_fp)) == 0;
+#endif
+	}
+
+	return true;
+}
+
+bool SpoolWriter::commit()
+{
+	if(!m_fp)
+		return false;
+
+	if(!finish(end() && sync()))
+		return false;
+
+#ifndef WIN32
+	// Make the rename stick too. The message is in the send directory by
+	// now and will be sent, so a failure here can't be reported to the client.
+	if(m_options.spoolSync() == SPOOL_SYNC_FULL && !sync_dir(m_options.sendDir()))
+		m_log.log(LOG_WARN, "SpoolWriter::commit(): Error syncing the send directory.");
+#endif
+
+	return true;
+}
+
+bool SpoolWriter::finish(bool synced)
+{
+	if(!synced)
+	{
+		m_log.log(LOG_SERVER, "SpoolWriter::finish(): Error writing send file '%s'.", m_filename);
+		abort();
+		return false;
+	}
+
+	int rc = fclose(m_fp);
+	m_fp = 0;
+	close();
+
+	if(rc != 0)
+	{
+		m_log.log(LOG_SERVER, "SpoolWriter::finish(): Error closing send file '%s'.", m_filename);
+		abort();
+		return false;
+	}
+
+	// Rename the file to have a MSG prefix instead of a NEW prefix. This
+	// indicates that the file is completely written out. Retry files get
+	// an RTY prefix, which the send directory watch ignores.
+	bool retry = (m_flags & SPOOL_FLAG_RETRY) != 0;
+	char *new_filename = strdupnew(m_filename);
+	char *name = strrchr(new_filename, DIR_DELIM);
+	name = name ? name + 1 : new_filename;
+	memcpy(name, retry ? "RTY" : "MSG", 3);
+
+	if(rename(m_filename, new_filename) != 0)
+	{
+		m_log.log(LOG_SERVER, "SpoolWriter::finish(): Error renaming send file '%s'.", m_filename);
+		delete[] new_filename;
+		abort();
+		return false;
+	}
+
+	if(m_sender && retry)
+		m_sender->schedule(new_filename, m_retry_next);
+	else if(m_sender)
+		m_sender->enqueue(new_filename, m_domain);
+	delete[] new_filename;
+
+	delete[] m_filename;
+	m_filename = 0;
+	m_committed = true;
+
+	return true;
+}
+
+void SpoolWriter::close()
+{
+#ifdef WIN32
+	_aligned_free(m_buf);
+#else
+	free(m_buf);
+#endif
+	m_buf = 0;
+	m_len = 0;
+
+	if(m_fp)
+	{
+		fclose(m_fp);
+		m_fp = 0;
+	}
+}
+
+void SpoolWriter::abort()
+{
+	close();
+
+	if(m_filename)
+	{
+		unlink(m_filename);
+		delete[] m_filename;
+		m_filename = 0;
+	}
+}
+
+//
+// SpoolCommitter
+//
+
+SpoolCommitter::SpoolCommitter(const Options & options)
+: m_options(options),
+m_queue(0),
+m_bQueueMutexCreated(false),
+m_bQueueSemCreated(false),
+m_bExitSemCreated(false),
+m_run(false)
+{
+}
+
+SpoolCommitter::~SpoolCommitter()
+{
+	stop();
+
+	if(m_bQueueMutexCreated)
+		delete_mutex(m_queue_mutex);
+	if(m_bQueueSemCreated)
+		delete_semaphore(m_queueSemaphore);
+	if(m_bExitSemCreated)
+		delete_semaphore(m_exitSemaphore);
+}
+
+bool SpoolCommitter::start()
+{
+	if(m_run)
+		return false;
+
+	if(create_mutex(m_queue_mutex))
+		m_bQueueMutexCreated = true;
+	else
+	{
+		m_log.log(LOG_ERROR, "SpoolCommitter::start(): Could not create queue mutex.");
+		return false;
+	}
+
+	if(create_semaphore(m_queueSemaphore))
+		m_bQueueSemCreated = true;
+	else
+	{
+		m_log.log(LOG_ERROR, "SpoolCommitter::start(): Could not create queue semaphore.");
+		return false;
+	}
+
+	if(create_semaphore(m_exitSemaphore))
+		m_bExitSemCreated = true;
+	else
+	{
+		m_log.log(LOG_ERROR, "SpoolCommitter::start(): Could not create exit semaphore.");
+		return false;
+	}
+
+	m_run = true;
+
+	if(!create_thread(thread_routine, this))
+	{
+		m_log.log(LOG_ERROR, "SpoolCommitter::start(): Could not create committer thread.");
+		m_run = false;
+		return false;
+	}
+
+	return true;
+}
+
+void SpoolCommitter::stop()
+{
+	if(!m_run)
+		return;
+
+	// Once m_run is false under the mutex add stops queuing files, so the
+	// thread can't miss one.
+	bool locked = wait_mutex(m_queue_mutex);
+	m_run = false;
+	if(locked)
+		release_mutex(m_queue_mutex);
+
+	signal_semaphore(m_queueSemaphore);
+
+	// The thread uses the committer, and calls back into the sessions, until
+	// the end.
+	wait_semaphore(m_exitSemaphore);
+}
+
+void SpoolCommitter::add(SpoolWriter* writer, void (*done)(void*), void* data)
+{
+	Commit *c = new Commit;
+	c->writer = writer;
+	c->done = done;
+	c->data = data;
+
+	if(!wait_mutex(m_queue_mutex))
+	{
+		// Commit it here rather than lose it.
+		m_log.log(LOG_WARN, "SpoolCommitter::add(): Could not acquire queue mutex.");
+		c->next = 0;
+		commitBatch(c);
+		return;
+	}
+
+	// The thread has been told to exit, so it may not see this one.
+	if(!m_run)
+	{
+		release_mutex(m_queue_mutex);
+		c->next = 0;
+		commitBatch(c);
+		return;
+	}
+
+	c->next = m_queue;
+	m_queue = c;
+	release_mutex(m_queue_mutex);
+
+	signal_semaphore(m_queueSemaphore);
+}
+
+THREAD_RETTYPE WINAPI SpoolCommitter::thread_routine(void* pData)
+{
+	SpoolCommitter *pThis = (SpoolCommitter*)pData;
+
+	for(;;)
+	{
+		if(!wait_semaphore(pThis->m_queueSemaphore))
+			break;
+
+		// Give other sessions a moment to finish their messages too.
+		unsigned int window = pThis->m_options.spoolCommitWindow();
+		if(window > 0 && pThis->m_run)
+			sleep_milliseconds(window);
+
+		if(!wait_mutex(pThis->m_queue_mutex))
+			continue;
+
+		Commit *queue = pThis->m_queue;
+		pThis->m_queue = 0;
+		release_mutex(pThis->m_queue_mutex);
+
+		// The semaphore was signaled for every file in the batch, but one
+		// wakeup is enough for all of them, so an empty queue is normal.
+		if(queue)
+		{
+			// Put the batch in the order the files were added.
+			Commit *batch = 0;
+			while(queue)
+			{
+				Commit *next = queue->next;
+				queue->next = batch;
+				batch = queue;
+				queue = next;
+			}
+
+			pThis->commitBatch(batch);
+		}
+		else if(!pThis->m_run)
+			break;
+	}
+
+	signal_semaphore(pThis->m_exitSemaphore);
+	return 0;
+}
+
+void SpoolCommitter::commitBatch(Commit* batch)
+{
+	unsigned int count = 0;
+	for(Commit *c = batch; c; c = c->next)
+		++count;
+
+	bool synced = false;
+
+#if defined(__linux__) && !defined(WIN32)
+	// All the spool files are on the same file system, so one syncfs does
+	// the work of a sync of each of them.
+	if(count > 1)
+	{
+		synced = syncfs(fileno(batch->writer->m_fp)) == 0;
+		if(!synced)
+			m_log.log(LOG_WARN, "SpoolCommitter::commitBatch(): syncfs failed. Syncing the files one at a time.");
+	}
+#endif
+
+	bool renamed = false;
+	for(Commit *c = batch; c; c = c->next)
+	{
+		if(c->writer->finish(synced || c->writer->sync()))
+			renamed = true;
+	}
+
+#ifndef WIN32
+	if(renamed && m_options.spoolSync() == SPOOL_SYNC_FULL && !sync_dir(m_options.sendDir()))
+		m_log.log(LOG_WARN, "SpoolCommitter::commitBatch(): Error syncing the send directory.");
+#endif
+
+	while(batch)
+	{
+		Commit *next = batch->next;
+		batch->done(batch->data);
+		delete batch;
+		batch = next;
+	}
+}
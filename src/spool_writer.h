@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// spool_writer.h - write a message into the send directory. The envelope and
+// text go through one big buffer, and the file is synced as much as the
+// spool_sync option asks for before it is handed to the sender. Syncing is
+// done for many files at once by a SpoolCommitter.
+
+#ifndef MAILSERV_SPOOL_WRITER_H
+#define MAILSERV_SPOOL_WRITER_H
+
+#include "log.h"
+#include "options.h"
+#include "sender.h"
+#include "thread.h"
+#include "spool_file.h"
+#include <stdio.h>
+
+// The size of the buffer. It is aligned to SPOOL_BUFALIGN so whole pages go
+// to the kernel.
+#define SPOOL_BUFLEN (128 * 1024)
+#define SPOOL_BUFALIGN 4096
+
+// A spool file is created as NEWxxx, which the sender ignores, and renamed
+// to MSGxxx once all of it is written (and synced). Then it is queued with
+// the Sender.
+class SpoolWriter
+{
+	Log m_log;
+	const Options & m_options;
+	Sender *m_sender;
+
+	FILE *m_fp;
+	char *m_filename; // The NEWxxx file.
+	char *m_buf;
+	unsigned int m_len; // The number of bytes in m_buf.
+	long m_offset; // Where in the file m_buf goes.
+	unsigned long m_envelope_length; // The bytes of mailboxes written so far.
+	unsigned int m_recipient_count;
+	char m_domain[SENDER_MAX_DOMAIN]; // The first recipient's domain, which the Sender queues the file by.
+	bool m_bSenderWritten;
+	unsigned int m_flags; // SPOOL_FLAG_* for the header.
+	time_t m_retry_next; // When to try a retry file again.
+	long m_body_offset; // Where the message text starts, or 0 before endEnvelope.
+	long m_reserved; // Where the space reserve asked for ends, or 0.
+	bool m_committed; // True if the last file was committed.
+
+	// Sync the file as the spool_sync option says. Returns false on error.
+	bool sync();
+
+	// Add a mailbox to the envelope. Returns false on error.
+	bool writeMailbox(const char* local, const char* domain);
+
+	// Close the file and rename it to MSGxxx if synced is true. Otherwise,
+	// or on error, remove it and return false.
+	bool finish(bool synced);
+
+	// Free the buffer and close the file.
+	void close();
+
+	// Not copyable. These have no definition.
+	SpoolWriter(const SpoolWriter &);
+	const SpoolWriter & operator=(const SpoolWriter &);
+
+	friend class SpoolCommitter;
+
+public:
+	// Committed files are queued with sender, unless it is NULL.
+	SpoolWriter(const Options & options, Sender* sender);
+	~SpoolWriter();
+
+	// Create a new spool file, leaving room for the header, which is filled
+	// in by end. Returns false on error.
+	bool open();
+
+	bool isOpen() const { return m_fp != NULL; }
+
+	// Add len bytes to the file. Returns false on error.
+	bool write(const char* data, unsigned int len);
+
+	// Write the envelope: the sender's mailbox first, then each recipient's,
+	// then endEnvelope. After that write adds to the message text. They
+	// return false on error.
+	//
+	// A file the Sender is keeping to try again starts with writeRetry. It is
+	// committed as RTYxxx and scheduled with the Sender rather than queued.
+	bool writeRetry(const SpoolRetry & retry);
+	bool writeSender(const char* local, const char* domain);
+	bool writeRecipient(const char* local, const char* domain);
+	bool endEnvelope();
+
+	// Write what is in the buffer to the file. Returns false on error.
+	bool flush();
+
+	// Write the rest of the file and fill in its header. Call it before handing
+	// the file to a SpoolCommitter; commit calls it itself. Returns false on
+	// error.
+	bool end();
+
+	// Let the file system know about size bytes more that are coming, so it
+	// can keep the file in one piece. The file's size doesn't change, and end
+	// gives back whatever the message didn't use.
+	void reserve(unsigned long size);
+
+	// Finish the file and rename it to MSGxxx. Returns false, having removed
+	// the file, on error.
+	bool commit();
+
+	// True if the file was renamed to MSGxxx by commit or a SpoolCommitter.
+	bool committed() const { return m_committed; }
+
+	// Close and remove the file.
+	void abort();
+};
+
+// SpoolCommitter syncs and renames spool files for the SMTP sessions on a
+// thread of its own. Files handed to it while it is busy, or within
+// spool_commit_window milliseconds of the first one, are committed together:
+// on Linux one syncfs covers all of them, and send_dir is synced once.
+class SpoolCommitter
+{
+	Log m_log;
+	const Options & m_options;
+
+	struct Commit
+	{
+		Commit *next;
+		SpoolWriter *writer;
+		void (*done)(void*);
+		void *data;
+	} *m_queue; // The newest first. Only access m_queue after acquiring m_queue_mutex.
+
+	MUTEX m_queue_mutex;
+	SEMAPHORE m_queueSemaphore; // Signaled for each file added to the queue.
+	bool m_bQueueMutexCreated;
+	bool m_bQueueSemCreated;
+	SEMAPHORE m_exitSemaphore; // Signaled by the committer thread as it exits.
+	bool m_bExitSemCreated;
+	volatile bool m_run; // Only set to false after acquiring m_queue_mutex.
+
+	// Commit a batch of files, oldest first, and call their done routines.
+	void commitBatch(Commit* batch);
+
+	static THREAD_RETTYPE WINAPI thread_routine(void* pData);
+
+	// Not copyable. These have no definition.
+	SpoolCommitter(const SpoolCommitter &);
+	const SpoolCommitter & operator=(const SpoolCommitter &);
+
+public:
+	SpoolCommitter(const Options & options);
+	~SpoolCommitter();
+
+	// Start the committer thread. Returns false on error.
+	bool start();
+
+	// Tell the committer thread to exit once the queue is empty, and wait for
+	// it. Files added after this are committed by add itself.
+	void stop();
+
+	// Commit the file writer has written, which must have been ended with end.
+	// done(data) is called on the committer thread afterwards, and
+	// writer->committed() says how it went. Neither writer nor what data
+	// points to may be touched until then.
+	void add(SpoolWriter* writer, void (*done)(void*), void* data);
+};
+
+#endif
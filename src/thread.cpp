@@ -31,16 +31,70 @@
 
 #ifdef WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
 bool create_thread(THREAD_RETTYPE (WINAPI *function_addr)(void*), void* data)
 {
+	// Nobody waits for the threads to finish, so don't keep anything around
+	// for them once they do.
 #ifdef WIN32
 	DWORD id;
-	return CreateThread(NULL, 0, function_addr, data, 0, &id) != NULL;
+	HANDLE h = CreateThread(NULL, 0, function_addr, data, 0, &id);
+	if(h == NULL)
+		return false;
+	CloseHandle(h);
+	return true;
 #else
 	pthread_t thread;
-	return pthread_create(&thread, NULL, function_addr, data) == 0;
+	pthread_attr_t attr;
+
+	if(pthread_attr_init(&attr) != 0)
+		return false;
+
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	bool rc = pthread_create(&thread, &attr, function_addr, data) == 0;
+	pthread_attr_destroy(&attr);
+
+	return rc;
+#endif
+}
+
+unsigned int cpu_count()
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (unsigned int)count : 1;
+#endif
+}
+
+bool set_thread_cpu(unsigned int cpu)
+{
+#if defined(WIN32)
+	if(cpu >= sizeof(DWORD_PTR) * 8)
+		return false;
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+#else
+	return false;
+#endif
+}
+
+void sleep_milliseconds(unsigned int ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
 #endif
 }
 
@@ -49,9 +49,20 @@ typedef sem_t SEMAPHORE;
 #endif
 
 // Returns true if the thread is created and able to run.
-// Returns false otherwise.
+// Returns false otherwise. The thread is detached, so its resources are
+// released as soon as it returns.
 bool create_thread(THREAD_RETTYPE (WINAPI *function_addr)(void*), void* data);
 
+// Returns the number of CPUs that are online (at least 1).
+unsigned int cpu_count();
+
+// Restrict the calling thread to run only on the given CPU. Threads it creates
+// afterwards inherit this. Returns false if it couldn't be done.
+bool set_thread_cpu(unsigned int cpu);
+
+// Put the calling thread to sleep for ms milliseconds.
+void sleep_milliseconds(unsigned int ms);
+
 bool create_mutex(MUTEX & mutex);
 void delete_mutex(MUTEX & mutex);
 bool wait_mutex(MUTEX & mutex);
@@ -32,6 +32,9 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifndef WIN32
+#include <sys/statvfs.h>
+#endif
 #include <stdlib.h>
 #include <ctype.h>
 
@@ -131,6 +134,32 @@ bool isdir(const char* path)
 	return sb.st_mode && S_IFDIR;
 }
 
+bool free_disk_space_kb(const char* path, unsigned long* pkbytes)
+{
+#ifdef WIN32
+	ULARGE_INTEGER avail;
+
+	if(!GetDiskFreeSpaceEx(path, &avail, NULL, NULL))
+		return false;
+
+	*pkbytes = (unsigned long)(avail.QuadPart / 1024);
+#else
+	struct statvfs sb;
+
+	if(statvfs(path, &sb) != 0)
+		return false;
+
+	// Work in kilobytes so a large disk doesn't overflow an unsigned long.
+	unsigned long block_size = sb.f_frsize ? sb.f_frsize : sb.f_bsize;
+	if(block_size >= 1024)
+		*pkbytes = sb.f_bavail * (block_size / 1024);
+	else
+		*pkbytes = sb.f_bavail / (1024 / block_size);
+#endif
+
+	return true;
+}
+
 struct in_addr *atoaddr(const char *address, in_addr * psaddr)
 {
    struct hostent *host;
@@ -213,6 +242,36 @@ bool nexttoken(char** pstr,
 	return true;
 }
 
+// command_key breaks words on the same characters nexttoken does by default.
+static inline bool is_command_delim(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' ||
+		c == ':' || c == '<' || c == '>';
+}
+
+unsigned int command_key(char** pstr)
+{
+	char *s = *pstr;
+	unsigned int key = 0;
+	int len = 0;
+
+	// Skip whitespace.
+	while(*s && isspace((unsigned char)*s))
+		++s;
+
+	// Clearing bit 5 upper cases letters, and can't turn anything else into
+	// one, so only letters can match a key.
+	for(; *s && !is_command_delim(*s); ++s, ++len)
+		key = key << 8 | (unsigned char)(*s & 0xDF);
+
+	*pstr = s;
+
+	if(len == 0 || len > 4)
+		return 0;
+
+	return key << (8 * (4 - len));
+}
+
 // A syntactically valid IP address is:
 // X.X.X.X, where 255 >= X >= 0.
 static bool isIP4addr(const char* addr)
@@ -339,17 +398,17 @@ static bool isLocalPart(const char* local_part)
 //                        IPv6-address-literal /
 //                        General-address-literal "]"
 
-// If mailbox_ok returns true then it points local_part and domain_part to
-// newly allocated memory (with new) that contains the local part and domain part
-// of the mailbox. You must free these with delete[]. If you pass in NULL for
-// one of these arguments then the local or domain part is not set.
-bool mailbox_ok(const char* mailbox, char** plocal_part_out, char** pdomain_part_out)
+// mailbox_split checks mailbox like mailbox_ok does, but modifies it in place:
+// white space around it is cut off and the '@' is replaced with a NULL. If it
+// returns true then local_part and domain_part point into mailbox, so nothing
+// needs to be freed. If you pass in NULL for one of these arguments then the
+// local or domain part is not set.
+bool mailbox_split(char* mailbox, char** plocal_part_out, char** pdomain_part_out)
 {
 	if(!mailbox)
 		return false;
 
-	char *tmp_mailbox = strdupnew(mailbox);
-	char *s = tmp_mailbox;
+	char *s = mailbox;
 
 	// Skip white space at beginning of mailbox.
 	while(*s && isspace(*s))
@@ -371,26 +430,48 @@ bool mailbox_ok(const char* mailbox, char** plocal_part_out, char** pdomain_part
 	// Chop off the tailing white space.
 	*end = 0;
 
-	bool rc = false;
 	char *local_part = s;
 	char *domain = strchr(s, '@');
 
-	if(local_part && *local_part != '@' && domain && domain[1])
-	{
-		// At this point we know that there is a local part and domain part.
-		// Now we need to make sure they are valid.
+	if(*local_part == '@' || !domain || !domain[1])
+		return false;
 
-		*domain = 0; // Replace '@' with NULL to break up the mailbox into two strings.
-		++domain;
+	// At this point we know that there is a local part and domain part.
+	// Now we need to make sure they are valid.
 
-		if(isLocalPart(local_part) && (isDomain(domain) || isIP4addr(domain)))
-		{
-			if(plocal_part_out)
-				*plocal_part_out = strdupnew(local_part);
-			if(pdomain_part_out)
-				*pdomain_part_out = strdupnew(domain);
-			rc = true;
-		}
+	*domain = 0; // Replace '@' with NULL to break up the mailbox into two strings.
+	++domain;
+
+	if(!isLocalPart(local_part) || !(isDomain(domain) || isIP4addr(domain)))
+		return false;
+
+	if(plocal_part_out)
+		*plocal_part_out = local_part;
+	if(pdomain_part_out)
+		*pdomain_part_out = domain;
+
+	return true;
+}
+
+// If mailbox_ok returns true then it points local_part and domain_part to
+// newly allocated memory (with new) that contains the local part and domain part
+// of the mailbox. You must free these with delete[]. If you pass in NULL for
+// one of these arguments then the local or domain part is not set.
+bool mailbox_ok(const char* mailbox, char** plocal_part_out, char** pdomain_part_out)
+{
+	if(!mailbox)
+		return false;
+
+	char *tmp_mailbox = strdupnew(mailbox);
+	char *local_part, *domain;
+	bool rc = mailbox_split(tmp_mailbox, &local_part, &domain);
+
+	if(rc)
+	{
+		if(plocal_part_out)
+			*plocal_part_out = strdupnew(local_part);
+		if(pdomain_part_out)
+			*pdomain_part_out = strdupnew(domain);
 	}
 
 	delete[] tmp_mailbox;
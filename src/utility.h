@@ -115,6 +115,10 @@ FILE* newfile(const char* path, const char* prefix, char** pNewFileName);
 // Returns true if path is a directory and false otherwise.
 bool isdir(const char* path);
 
+// Get the number of kilobytes free for ordinary users on the file system that
+// holds path. Returns false if it can't be found out.
+bool free_disk_space_kb(const char* path, unsigned long* pkbytes);
+
 // Converts ascii text to in_addr struct.  NULL is returned if the 
 // address can not be found.
 struct in_addr *atoaddr(const char *address, in_addr * psaddr);
@@ -128,12 +132,30 @@ struct in_addr *atoaddr(const char *address, in_addr * psaddr);
 bool nexttoken(char** pstr, char* buf, int maxbuf,
 			   const char* delim = NULL, const char* delim_tokens = NULL);
 
+// COMMAND_KEY builds the key command_key returns for an SMTP or POP3 command,
+// so commands can be looked up with a switch. Pass 0 for the missing letters
+// of commands shorter than four letters.
+#define COMMAND_KEY(a, b, c, d) \
+	((unsigned int)(unsigned char)(a) << 24 | (unsigned int)(unsigned char)(b) << 16 | \
+	 (unsigned int)(unsigned char)(c) << 8 | (unsigned int)(unsigned char)(d))
+
+// command_key gets the command word at the start of *pstr, upper cased, as a
+// COMMAND_KEY and sets pstr to the location after the word, like nexttoken
+// does, but without copying the word. 0 is returned if there is no word or
+// it is longer than four letters, since no command is.
+unsigned int command_key(char** pstr);
+
 // If mailbox_ok returns true then it points local_part and domain_part to
 // newly allocated memory (with new) that contains the local part and domain part
 // of the mailbox. You must free these with delete[]. If you pass in NULL for
 // one of these arguments then the local or domain part is not set.
 bool mailbox_ok(const char* mailbox, char** plocal_part_out, char** pdomain_part_out);
 
+// mailbox_split checks a mailbox like mailbox_ok does, but splits it up where
+// it is instead of copying it. If it returns true the local part and domain
+// part point into mailbox, which has been modified to NULL terminate them.
+bool mailbox_split(char* mailbox, char** plocal_part_out, char** pdomain_part_out);
+
 // Get a RFC 2822 date. If the date is successfully stored in buf, then true is returned.
 // Otherwise, false is returned.
 bool get_rfc_2822_datetime(time_t t, char *buf, size_t bufSize);
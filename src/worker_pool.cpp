@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool()
+: m_queue(0),
+m_queue_length(0),
+m_queue_head(0),
+m_queue_count(0),
+m_thread_count(0),
+m_bQueueMutexCreated(false),
+m_bJobSemCreated(false),
+m_bExitSemCreated(false),
+m_run(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+
+	if(m_bQueueMutexCreated)
+		delete_mutex(m_queue_mutex);
+	if(m_bJobSemCreated)
+		delete_semaphore(m_jobSemaphore);
+	if(m_bExitSemCreated)
+		delete_semaphore(m_exitSemaphore);
+
+	delete[] m_queue;
+}
+
+bool WorkerPool::start(unsigned int thread_count, unsigned int queue_length)
+{
+	if(m_run)
+		return false;
+
+	if(create_mutex(m_queue_mutex))
+		m_bQueueMutexCreated = true;
+	else
+	{
+		m_log.log(LOG_ERROR, "WorkerPool::start(): Could not create queue mutex.");
+		return false;
+	}
+
+	if(create_semaphore(m_jobSemaphore))
+		m_bJobSemCreated = true;
+	else
+	{
+		m_log.log(LOG_ERROR, "WorkerPool::start(): Could not create job semaphore.");
+		return false;
+	}
+
+	if(create_semaphore(m_exitSemaphore))
+		m_bExitSemCreated = true;
+	else
+	{
+		m_log.log(LOG_ERROR, "WorkerPool::start(): Could not create exit semaphore.");
+		return false;
+	}
+
+	m_queue_length = queue_length;
+	m_queue = new Job[m_queue_length];
+	m_run = true;
+
+	for(unsigned int i = 0; i < thread_count; ++i)
+	{
+		if(create_thread(thread_routine, this))
+			++m_thread_count;
+		else
+			m_log.log(LOG_WARN, "WorkerPool::start(): Error creating worker thread #%u", i);
+	}
+
+	if(m_thread_count == 0)
+	{
+		m_log.log(LOG_ERROR, "WorkerPool::start(): Could not create any worker threads.");
+		m_run = false;
+		return false;
+	}
+
+	return true;
+}
+
+bool WorkerPool::submit(THREAD_RETTYPE (WINAPI *routine)(void*), void (*discard)(void*), void* data,
+						bool force)
+{
+	if(!m_run || !wait_mutex(m_queue_mutex))
+		return false;
+
+	// stop may have been called while we waited, and nothing would run the job.
+	if(!m_run)
+	{
+		release_mutex(m_queue_mutex);
+		return false;
+	}
+
+	if(force && m_queue_count == m_queue_length)
+	{
+		// Double the queue, moving the jobs to the front of the new one.
+		unsigned int new_length = m_queue_length * 2;
+		Job *new_queue = new Job[new_length];
+
+		for(unsigned int i = 0; i < m_queue_count; ++i)
+			new_queue[i] = m_queue[(m_queue_head + i) % m_queue_length];
+
+		delete[] m_queue;
+		m_queue = new_queue;
+		m_queue_length = new_length;
+		m_queue_head = 0;
+	}
+
+	bool rc = m_queue_count < m_queue_length;
+
+	if(rc)
+	{
+		Job & job = m_queue[(m_queue_head + m_queue_count) % m_queue_length];
+		job.routine = routine;
+		job.discard = discard;
+		job.data = data;
+		++m_queue_count;
+	}
+
+	release_mutex(m_queue_mutex);
+
+	if(rc)
+		signal_semaphore(m_jobSemaphore);
+
+	return rc;
+}
+
+void WorkerPool::stop()
+{
+	if(!m_run)
+		return;
+
+	// Once m_run is false under the mutex no more jobs can be queued.
+	bool locked = wait_mutex(m_queue_mutex);
+	m_run = false;
+	if(locked)
+		release_mutex(m_queue_mutex);
+
+	// Wake up every thread so it sees m_run is false.
+	for(unsigned int i = 0; i < m_thread_count; ++i)
+		signal_semaphore(m_jobSemaphore);
+
+	// The threads use the pool until the end, so it can't be deleted before then.
+	for(unsigned int i = 0; i < m_thread_count; ++i)
+		wait_semaphore(m_exitSemaphore);
+
+	// There is nobody left to run the jobs that are still queued.
+	while(m_queue_count > 0)
+	{
+		Job job = m_queue[m_queue_head];
+		m_queue_head = (m_queue_head + 1) % m_queue_length;
+		--m_queue_count;
+
+		if(job.discard)
+			job.discard(job.data);
+	}
+}
+
+THREAD_RETTYPE WINAPI WorkerPool::thread_routine(void* pData)
+{
+	WorkerPool *pThis = (WorkerPool*)pData;
+
+	while(wait_semaphore(pThis->m_jobSemaphore) && pThis->m_run)
+	{
+		if(!wait_mutex(pThis->m_queue_mutex))
+			continue;
+
+		if(pThis->m_queue_count == 0)
+		{
+			pThis->m_log.log(LOG_WARN, "WorkerPool::thread_routine(): Error: The queue is empty but the semaphore indicates it shouldn't be.");
+			release_mutex(pThis->m_queue_mutex);
+			continue;
+		}
+
+		Job job = pThis->m_queue[pThis->m_queue_head];
+		pThis->m_queue_head = (pThis->m_queue_head + 1) % pThis->m_queue_length;
+		--pThis->m_queue_count;
+
+		release_mutex(pThis->m_queue_mutex);
+
+		job.routine(job.data);
+	}
+
+	signal_semaphore(pThis->m_exitSemaphore);
+	return 0;
+}
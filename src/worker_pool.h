@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2003, Douglas Ryan Richardson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the organization nor the names of its contributors may
+ *   be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAILSERV_WORKER_POOL_H
+#define MAILSERV_WORKER_POOL_H
+
+#include "log.h"
+#include "thread.h"
+
+// WorkerPool runs jobs on a fixed number of threads. Jobs are handed to the
+// threads through a queue of limited length, so a flood of work can't create
+// an unlimited number of threads or use an unlimited amount of memory.
+class WorkerPool
+{
+	Log m_log;
+
+	struct Job
+	{
+		THREAD_RETTYPE (WINAPI *routine)(void*);
+		void (*discard)(void*); // Called instead of routine if the pool is stopped first, or NULL.
+		void *data;
+	} *m_queue; // A circular buffer of jobs waiting for a thread.
+
+	unsigned int m_queue_length; // The most jobs m_queue can hold.
+	unsigned int m_queue_head; // The index of the oldest job in m_queue.
+	unsigned int m_queue_count; // The number of jobs in m_queue.
+	unsigned int m_thread_count; // The number of threads started.
+
+	MUTEX m_queue_mutex; // Only access the queue after acquiring m_queue_mutex.
+	bool m_bQueueMutexCreated;
+	SEMAPHORE m_jobSemaphore; // Signaled once for each job added to the queue.
+	bool m_bJobSemCreated;
+	SEMAPHORE m_exitSemaphore; // Signaled by each thread as it exits.
+	bool m_bExitSemCreated;
+	volatile bool m_run; // Only set to false after acquiring m_queue_mutex.
+
+	static THREAD_RETTYPE WINAPI thread_routine(void* pThis);
+
+	// The assignment operator is made private so that no one uses it. It has no definition.
+	WorkerPool(const WorkerPool &);
+	const WorkerPool & operator=(const WorkerPool &);
+
+public:
+	WorkerPool();
+	~WorkerPool();
+
+	// Start thread_count threads and allow up to queue_length jobs to wait
+	// for one of them. Returns false if the pool could not be started.
+	bool start(unsigned int thread_count, unsigned int queue_length);
+
+	// Queue routine to be called with data on one of the pool's threads. If
+	// the pool is stopped before a thread gets to it, discard (unless it is
+	// NULL) is called with data instead, to free it.
+	// Returns false, without queuing it, if the queue is full or the pool has
+	// been stopped. If force is true the queue is made longer instead, for work
+	// that can't be turned away, such as the next step of a session that has
+	// already been accepted.
+	bool submit(THREAD_RETTYPE (WINAPI *routine)(void*), void (*discard)(void*), void* data,
+		bool force = false);
+
+	// Tell the threads to exit once they finish the job they are working on,
+	// and wait for them. Jobs that are still queued are discarded.
+	void stop();
+};
+
+#endif